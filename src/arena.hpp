@@ -0,0 +1,105 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <vector>
+
+// Bump allocator over a list of chunks. Memory is only ever freed all at once
+// (by Reset or destruction), so pointers stay valid even when the arena itself
+// is moved. Chunk sizes double from `sizFirstChunk` up to `sizMaxChunk`, which
+// keeps arenas that only hold a few bytes small.
+struct Arena {
+  Arena(size_t sizFirstChunk = 1024, size_t sizMaxChunk = 64 * 1024)
+      : sizNextChunk(sizFirstChunk), sizMaxChunk(sizMaxChunk) {}
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  Arena(Arena &&) = default;
+  Arena &operator=(Arena &&) = default;
+
+  void *Alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+    assert(align != 0 && (align & (align - 1)) == 0);
+
+    while (idxChunk < chunks.size()) {
+      auto &chunk = chunks[idxChunk];
+      auto base = (uintptr_t)chunk.data.get();
+      auto offAligned = ((base + offCursor + align - 1) & ~(align - 1)) - base;
+      if (offAligned + size <= chunk.size) {
+        offCursor = offAligned + size;
+        return chunk.data.get() + offAligned;
+      }
+
+      // Chunks kept around by Reset are reused before allocating new ones
+      idxChunk++;
+      offCursor = 0;
+    }
+
+    Chunk chunk;
+    chunk.size = std::max(sizNextChunk, size + align);
+    chunk.data = std::make_unique<char[]>(chunk.size);
+    sizNextChunk = std::min(sizNextChunk * 2, sizMaxChunk);
+    chunks.push_back(std::move(chunk));
+    idxChunk = chunks.size() - 1;
+    offCursor = 0;
+
+    return Alloc(size, align);
+  }
+
+  template <typename T>
+  T *AllocArray(size_t count) {
+    return (T *)Alloc(sizeof(T) * count, alignof(T));
+  }
+
+  // Copies `len` bytes and appends a null-terminator
+  char *CopyString(const char *str, size_t len) {
+    auto *ret = AllocArray<char>(len + 1);
+    memcpy(ret, str, len);
+    ret[len] = '\0';
+    return ret;
+  }
+
+  // Takes over the chunks of `other`; what was allocated from it stays valid
+  // and is freed together with this arena
+  void Merge(Arena &&other) {
+    // The chunks go before the current one, so that they're never mistaken
+    // for chunks kept around by Reset
+    auto numChunks = other.chunks.size();
+    chunks.insert(chunks.begin() + idxChunk,
+                  std::make_move_iterator(other.chunks.begin()),
+                  std::make_move_iterator(other.chunks.end()));
+    idxChunk += numChunks;
+    other.chunks.clear();
+    other.Reset();
+  }
+
+  // Bytes allocated from the system, used or not
+  size_t GetCapacity() const {
+    size_t ret = 0;
+    for (auto &chunk : chunks) {
+      ret += chunk.size;
+    }
+    return ret;
+  }
+
+  // Invalidates every allocation but keeps the chunks for reuse
+  void Reset() {
+    idxChunk = 0;
+    offCursor = 0;
+  }
+
+  struct Chunk {
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+  };
+
+  std::vector<Chunk> chunks;
+  size_t idxChunk = 0;
+  size_t offCursor = 0;
+  size_t sizNextChunk;
+  size_t sizMaxChunk;
+};
@@ -0,0 +1,73 @@
+#include "budget.hpp"
+
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+#include "BTracy.hpp"
+
+struct Budget {
+  std::mutex lock;
+  std::condition_variable cv;
+  const size_t limit = BUDGET_DEFAULT;
+  size_t inUse = 0;
+  size_t numWaiting = 0;
+};
+
+static Budget gBudget;
+
+// Must be called with the lock held
+static void Plot() {
+  TracyPlot("Budget in use", (int64_t)gBudget.inUse);
+  TracyPlot("Budget waiters", (int64_t)gBudget.numWaiting);
+}
+
+bool Budget_Acquire(size_t bytes, const std::atomic<bool> &aborted) {
+  ZoneScoped;
+  std::unique_lock L(gBudget.lock);
+  auto fits = [&]() {
+    return gBudget.inUse == 0 || gBudget.inUse + bytes <= gBudget.limit;
+  };
+
+  if (!fits()) {
+    ZoneScopedN("Wait for budget");
+    gBudget.numWaiting++;
+    Plot();
+    gBudget.cv.wait(L, [&]() { return fits() || aborted; });
+    gBudget.numWaiting--;
+    if (!fits()) {
+      Plot();
+      return false;
+    }
+  }
+
+  gBudget.inUse += bytes;
+  Plot();
+  return true;
+}
+
+void Budget_Charge(size_t bytes) {
+  std::lock_guard G(gBudget.lock);
+  gBudget.inUse += bytes;
+  Plot();
+}
+
+void Budget_Release(size_t bytes) {
+  if (bytes == 0) {
+    return;
+  }
+
+  std::lock_guard G(gBudget.lock);
+  assert(gBudget.inUse >= bytes);
+  gBudget.inUse -= bytes;
+  Plot();
+  gBudget.cv.notify_all();
+}
+
+void Budget_WakeWaiters() {
+  // Taking the lock makes sure that a waiter that has just seen its flag
+  // unset is already waiting
+  std::lock_guard G(gBudget.lock);
+  gBudget.cv.notify_all();
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+
+// Process-wide limit on the memory the match threads hold at once: mapped
+// file contents, decompression buffers, line tables and results that haven't
+// been published yet. Workers block in Budget_Acquire while the budget is
+// exhausted, so fewer files are in flight when they are large.
+enum {
+  BUDGET_DEFAULT = 1024 * 1024 * 1024,
+};
+
+// Blocks until `bytes` fit into the budget. A request larger than the whole
+// budget is granted once nothing else is held. Returns false without
+// acquiring anything if `aborted` became set while waiting.
+bool Budget_Acquire(size_t bytes, const std::atomic<bool> &aborted);
+// Counts `bytes` against the budget without waiting; for memory that is
+// already allocated or that can't wait without risking a deadlock
+void Budget_Charge(size_t bytes);
+// Gives back bytes taken by Budget_Acquire or Budget_Charge
+void Budget_Release(size_t bytes);
+// Makes the threads waiting in Budget_Acquire check their `aborted` flag;
+// call after setting it
+void Budget_WakeWaiters();
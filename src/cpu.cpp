@@ -0,0 +1,86 @@
+#include "cpu.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+
+#if WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Indices at or above this can't be pinned to, and are rejected before ranges
+// are expanded
+#if WIN32
+enum { NUM_CPU_MAX = sizeof(DWORD_PTR) * 8 };
+#elif defined(__linux__)
+enum { NUM_CPU_MAX = CPU_SETSIZE };
+#else
+enum { NUM_CPU_MAX = 1024 };
+#endif
+
+bool Cpu_ParseSet(std::vector<uint32_t> &out, const std::string &spec) {
+  out.clear();
+  auto *cur = spec.c_str();
+  while (*cur != '\0') {
+    char *end;
+    auto first = strtoul(cur, &end, 10);
+    if (end == cur || first >= NUM_CPU_MAX) {
+      return false;
+    }
+    auto last = first;
+    cur = end;
+    if (*cur == '-') {
+      cur++;
+      last = strtoul(cur, &end, 10);
+      if (end == cur || last < first || last >= NUM_CPU_MAX) {
+        return false;
+      }
+      cur = end;
+    }
+
+    for (auto cpu = first; cpu <= last; cpu++) {
+      out.push_back((uint32_t)cpu);
+    }
+
+    if (*cur == ',') {
+      cur++;
+    } else if (*cur != '\0') {
+      return false;
+    }
+  }
+
+  std::sort(out.begin(), out.end());
+  out.erase(std::unique(out.begin(), out.end()), out.end());
+  return !out.empty();
+}
+
+bool Cpu_PinThread(std::thread &thread, const std::vector<uint32_t> &cpus) {
+#if WIN32
+  DWORD_PTR mask = 0;
+  for (auto cpu : cpus) {
+    // Processor groups beyond the first aren't handled
+    if (cpu < sizeof(mask) * 8) {
+      mask |= (DWORD_PTR)1 << cpu;
+    }
+  }
+  return mask != 0 &&
+         SetThreadAffinityMask((HANDLE)thread.native_handle(), mask) != 0;
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus) {
+    if (cpu < CPU_SETSIZE) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  return pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set) ==
+         0;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parses a list of CPU indices and ranges like "0-3,8,10-11". Returns false if
+// the list is malformed or empty.
+bool Cpu_ParseSet(std::vector<uint32_t> &out, const std::string &spec);
+// Restricts `thread` to the CPUs in `cpus`. Returns false where pinning isn't
+// supported or the OS refused it.
+bool Cpu_PinThread(std::thread &thread, const std::vector<uint32_t> &cpus);
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 struct LineInfo {
@@ -7,12 +8,46 @@ struct LineInfo {
   size_t offEnd;
 };
 
+// Capture group of a match. Offsets are relative to the start of the matching
+// line, like Match::idxColumn.
+struct MatchGroup {
+  uint32_t offStart;
+  uint32_t offEnd;
+};
+
+// Offsets of groups that didn't participate in the match
+static constexpr uint32_t MATCH_GROUP_UNSET = UINT32_MAX;
+
 struct Match {
   size_t offStart;
   size_t offEnd;
 
   size_t idxLine;
   size_t idxColumn;
+  // Last line the match touches; past `idxLine` if it spans newlines
+  size_t idxLineEnd;
+
+  // Lines around the match, copied by the worker while the file was mapped.
+  // Lines are separated by '\n' and the whole snippet is null-terminated. It
+  // lives in the arena of the file's result.
+  const char *snippet;
+  size_t lenSnippet;
+  size_t idxSnippetFirstLine;
+  // Location of the matching lines inside the snippet, from the start of
+  // `idxLine` to the end of `idxLineEnd` unless the match spans too many lines
+  // to capture them all
+  size_t offSnippetLine;
+  size_t lenSnippetLine;
+
+  // Groups 1 to numGroups; groups past the last one that participated in the
+  // match are left out. In the same arena as the snippet.
+  const MatchGroup *groups;
+  uint32_t numGroups;
+
+  // In replace mode, the text that replaces the match; in the same arena as
+  // the snippet
+  const char *replacement;
+  size_t lenReplacement;
 };
 
 struct FileResult {
@@ -24,8 +59,57 @@ struct FileResult {
 struct GrepState {
 };
 
+enum SymlinkPolicy {
+  SYMLINKS_NEVER = 0,
+  // Only the root path itself may be a symlink (like find -H)
+  SYMLINKS_ROOT_ONLY,
+  SYMLINKS_ALWAYS,
+  SYMLINKS_MAX
+};
+
+enum OutputMode {
+  // Every match with its line and context
+  OUTPUT_MATCHES = 0,
+  // Only the paths of the files that match (like grep -l)
+  OUTPUT_FILES_WITH_MATCHES,
+  // Only the paths of the files that don't match (like grep -L)
+  OUTPUT_FILES_WITHOUT_MATCH,
+  // The number of matches of each matching file (like grep -c, but counting
+  // matches rather than lines)
+  OUTPUT_COUNT,
+  OUTPUT_MAX
+};
+
 struct GrepRequest {
   std::string pathRoot;
   std::string patternFilename;
   std::string pattern;
+  bool caseInsensitive = false;
+  // Treat `pattern` as a literal string instead of a regex (like grep -F)
+  bool fixedString = false;
+  // ^ and $ match at every line boundary (PCRE2_MULTILINE). Otherwise they
+  // never match, since files are searched as a whole rather than per line.
+  bool multiline = false;
+  // Number of lines captured around each match for the preview
+  uint32_t numContextBefore = 2;
+  uint32_t numContextAfter = 2;
+  // Replace mode always shows every match
+  OutputMode outputMode = OUTPUT_MATCHES;
+  // Matches reported in total and per file, or 0 for no limit (like grep -m).
+  // Once the total is reached, the search stops early. Files listed as
+  // without a match don't count toward it.
+  uint64_t maxCount = 0;
+  uint64_t maxCountPerFile = 0;
+  // Rewrite every match with `replacement`, in which $n, ${n} and ${name}
+  // refer to capture groups and $$ is a literal '$'. With `dryRun`, the
+  // replacements are only shown.
+  bool replace = false;
+  std::string replacement;
+  bool dryRun = true;
+  // Include/exclude rules on paths, sizes and ages; see PathRules
+  std::string pathRules;
+  SymlinkPolicy followSymlinks = SYMLINKS_ROOT_ONLY;
+  // Search files with multiple hardlinks only once. Directories are never
+  // walked twice, regardless of this.
+  bool dedupeFiles = true;
 };
@@ -0,0 +1,209 @@
+#include "decomp.hpp"
+
+#include <zlib.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+struct Decompressor_t {
+  DecompressorFormat format;
+  const uint8_t *input;
+  size_t sizInput;
+  size_t offInput = 0;
+  bool finished = false;
+  // The input ended before the end of the last stream
+  bool truncated = false;
+
+  z_stream zs = {};
+  ZSTD_DCtx *zstd = nullptr;
+};
+
+DecompressorFormat Decomp_DetectFormat(const void *buf, size_t len) {
+  static const uint8_t magicGzip[] = {0x1f, 0x8b};
+  static const uint8_t magicZstd[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+  if (len >= sizeof(magicGzip) &&
+      memcmp(buf, magicGzip, sizeof(magicGzip)) == 0) {
+    return Decomp_Gzip;
+  }
+  if (len >= sizeof(magicZstd) &&
+      memcmp(buf, magicZstd, sizeof(magicZstd)) == 0) {
+    return Decomp_Zstd;
+  }
+  return Decomp_Plain;
+}
+
+DecompressorFormat Decomp_DetectFileFormat(const std::string &path) {
+  uint8_t magic[4];
+  auto *file = fopen(path.c_str(), "rb");
+  if (!file) {
+    return Decomp_Plain;
+  }
+  auto len = fread(magic, 1, sizeof(magic), file);
+  fclose(file);
+  return Decomp_DetectFormat(magic, len);
+}
+
+DecompressorStatus Decomp_Open(DecompressorHandle &out,
+                               DecompressorFormat format,
+                               const void *input,
+                               size_t len) {
+  auto *ret = new Decompressor_t;
+  ret->format = format;
+  ret->input = (const uint8_t *)input;
+  ret->sizInput = len;
+
+  switch (format) {
+    case Decomp_Gzip:
+      // 32 enables automatic detection of the gzip header
+      if (inflateInit2(&ret->zs, 15 + 32) != Z_OK) {
+        delete ret;
+        return Decomp_Failure;
+      }
+      break;
+    case Decomp_Zstd:
+      ret->zstd = ZSTD_createDCtx();
+      if (ret->zstd == nullptr) {
+        delete ret;
+        return Decomp_Failure;
+      }
+      break;
+    case Decomp_Plain:
+      break;
+  }
+
+  out = ret;
+  return Decomp_OK;
+}
+
+static DecompressorStatus ReadGzip(Decompressor_t *file,
+                                   void *buf,
+                                   size_t cap,
+                                   size_t &out_len) {
+  auto &zs = file->zs;
+  zs.next_out = (Bytef *)buf;
+  // zlib counts in uInt
+  zs.avail_out = (uInt)std::min<size_t>(cap, UINT32_MAX);
+  // Also what was inflated before an error is handed out
+  DecompressorStatus rcRead = Decomp_OK;
+
+  while (zs.avail_out > 0) {
+    auto sizRemaining = file->sizInput - file->offInput;
+    zs.next_in = (Bytef *)file->input + file->offInput;
+    zs.avail_in = (uInt)std::min<size_t>(sizRemaining, UINT32_MAX);
+    auto availIn = zs.avail_in;
+    auto rc = inflate(&zs, Z_NO_FLUSH);
+    file->offInput += availIn - zs.avail_in;
+
+    if (rc == Z_STREAM_END) {
+      // Another member may follow; anything else after the end of a member
+      // (usually padding) is ignored
+      if (Decomp_DetectFormat(file->input + file->offInput,
+                              file->sizInput - file->offInput) != Decomp_Gzip) {
+        file->finished = true;
+        break;
+      }
+      if (inflateReset(&zs) != Z_OK) {
+        rcRead = Decomp_Failure;
+        break;
+      }
+    } else if (rc == Z_BUF_ERROR && file->offInput == file->sizInput) {
+      // Nothing more to do without more input
+      file->finished = true;
+      file->truncated = true;
+      break;
+    } else if (rc != Z_OK) {
+      rcRead = Decomp_Failure;
+      break;
+    }
+  }
+
+  out_len = (uint8_t *)zs.next_out - (uint8_t *)buf;
+  return rcRead;
+}
+
+static DecompressorStatus ReadZstd(Decompressor_t *file,
+                                   void *buf,
+                                   size_t cap,
+                                   size_t &out_len) {
+  ZSTD_outBuffer output = {buf, cap, 0};
+  ZSTD_inBuffer input = {file->input, file->sizInput, file->offInput};
+
+  // Nonzero while a frame is incomplete or not fully flushed
+  size_t rc = 0;
+  do {
+    rc = ZSTD_decompressStream(file->zstd, &output, &input);
+    if (ZSTD_isError(rc)) {
+      // Also what was decompressed before the error is handed out
+      file->offInput = input.pos;
+      out_len = output.pos;
+      return Decomp_Failure;
+    }
+  } while (output.pos < output.size && input.pos < input.size);
+
+  file->offInput = input.pos;
+  out_len = output.pos;
+
+  // With room left in the output buffer, the decoder has flushed everything
+  // it could
+  if (input.pos == input.size && output.pos < output.size) {
+    file->finished = true;
+    file->truncated = rc != 0;
+  }
+  return Decomp_OK;
+}
+
+DecompressorStatus Decomp_Read(DecompressorHandle file,
+                               void *buf,
+                               size_t cap,
+                               size_t &out_len) {
+  if (!file) {
+    return Decomp_InvalidHandle;
+  }
+
+  out_len = 0;
+  if (file->finished) {
+    return file->truncated ? Decomp_Truncated : Decomp_EndOfStream;
+  }
+
+  DecompressorStatus rc = Decomp_OK;
+  switch (file->format) {
+    case Decomp_Gzip:
+      rc = ReadGzip(file, buf, cap, out_len);
+      break;
+    case Decomp_Zstd:
+      rc = ReadZstd(file, buf, cap, out_len);
+      break;
+    case Decomp_Plain:
+      out_len = std::min(cap, file->sizInput - file->offInput);
+      memcpy(buf, file->input + file->offInput, out_len);
+      file->offInput += out_len;
+      file->finished = file->offInput == file->sizInput;
+      break;
+  }
+
+  if (rc != Decomp_OK || !file->finished) {
+    return rc;
+  }
+  return file->truncated ? Decomp_Truncated : Decomp_EndOfStream;
+}
+
+DecompressorStatus Decomp_Close(DecompressorHandle &file) {
+  if (!file) {
+    return Decomp_InvalidHandle;
+  }
+
+  if (file->format == Decomp_Gzip) {
+    inflateEnd(&file->zs);
+  }
+  if (file->zstd != nullptr) {
+    ZSTD_freeDCtx(file->zstd);
+  }
+
+  delete file;
+  file = nullptr;
+  return Decomp_OK;
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+typedef struct Decompressor_t *DecompressorHandle;
+
+enum DecompressorFormat {
+  Decomp_Plain,
+  Decomp_Gzip,
+  Decomp_Zstd,
+};
+
+enum DecompressorStatus {
+  Decomp_OK,
+  // Every byte of the input has been decompressed
+  Decomp_EndOfStream,
+  // Like Decomp_EndOfStream, but the input ended in the middle of a stream
+  Decomp_Truncated,
+  Decomp_Failure,
+  Decomp_InvalidHandle,
+};
+
+// Looks at the magic bytes at the start of `buf`
+DecompressorFormat Decomp_DetectFormat(const void *buf, size_t len);
+// Reads the magic bytes at the start of the file, without mapping it. Files
+// that can't be read count as plain.
+DecompressorFormat Decomp_DetectFileFormat(const std::string &path);
+// `input` must stay valid until the handle is closed. Concatenated gzip members
+// and zstd frames are decompressed as a single stream.
+DecompressorStatus Decomp_Open(DecompressorHandle &out,
+                               DecompressorFormat format,
+                               const void *input,
+                               size_t len);
+// Decompresses up to `cap` bytes into `buf`. Returns Decomp_EndOfStream or
+// Decomp_Truncated once the input is exhausted, and Decomp_Failure if the
+// input is corrupt; `out_len` may be nonzero in all of these cases. Nothing
+// is reported; the caller decides what a damaged stream means.
+DecompressorStatus Decomp_Read(DecompressorHandle file,
+                               void *buf,
+                               size_t cap,
+                               size_t &out_len);
+DecompressorStatus Decomp_Close(DecompressorHandle &file);
@@ -0,0 +1,127 @@
+#include "dirlist.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+
+#include "BTracy.hpp"
+#include "win32.hpp"
+
+enum {
+  // Names are handed over to the UI in batches of this size or every
+  // DIRLIST_FLUSH_INTERVAL_MS, whichever comes first
+  DIRLIST_BATCH_SIZE = 1024,
+  DIRLIST_FLUSH_INTERVAL_MS = 16,
+};
+
+struct DirectoryListing {
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> finished{false};
+
+  std::mutex lock;
+  // Guarded by `lock`
+  std::vector<std::string> pending;
+};
+
+static void Cancel(std::shared_ptr<DirectoryListing> &listing) {
+  if (listing) {
+    listing->cancelled = true;
+    listing.reset();
+  }
+}
+
+static void threadprocList(std::shared_ptr<DirectoryListing> listing,
+                           std::filesystem::path root) {
+  tracy::SetThreadName("Thread-DirList");
+  ZoneScoped;
+
+  std::vector<std::string> batch;
+  auto timeLastFlush = std::chrono::steady_clock::now();
+  auto flush = [&]() {
+    std::lock_guard G(listing->lock);
+    if (listing->pending.empty()) {
+      listing->pending.swap(batch);
+    } else {
+      listing->pending.insert(listing->pending.end(),
+                              std::make_move_iterator(batch.begin()),
+                              std::make_move_iterator(batch.end()));
+      batch.clear();
+    }
+    timeLastFlush = std::chrono::steady_clock::now();
+  };
+
+  if (root.empty()) {
+    auto drives = W32_GetLogicalDriveStrings();
+    if (drives.empty()) {
+      root = std::filesystem::path("/");
+    } else {
+      batch = std::move(drives);
+    }
+  }
+
+  if (!root.empty()) {
+    // The error_code overloads are used throughout; a directory that can't be
+    // read simply ends the listing
+    std::error_code ec;
+    std::filesystem::directory_iterator it(root, ec);
+    for (; !ec && it != std::filesystem::directory_iterator();
+         it.increment(ec)) {
+      if (listing->cancelled) {
+        return;
+      }
+
+      std::error_code ecEntry;
+      if (it->is_directory(ecEntry)) {
+        batch.push_back(it->path().filename().u8string());
+      }
+
+      auto now = std::chrono::steady_clock::now();
+      if (batch.size() >= DIRLIST_BATCH_SIZE ||
+          (!batch.empty() &&
+           now - timeLastFlush >=
+               std::chrono::milliseconds(DIRLIST_FLUSH_INTERVAL_MS))) {
+        flush();
+      }
+    }
+  }
+
+  flush();
+  listing->finished = true;
+}
+
+DirectoryLister::DirectoryLister(const std::filesystem::path &root)
+    : listing(std::make_shared<DirectoryListing>()) {
+  std::thread(threadprocList, listing, root).detach();
+}
+
+DirectoryLister::~DirectoryLister() {
+  Cancel(listing);
+}
+
+DirectoryLister &DirectoryLister::operator=(DirectoryLister &&other) {
+  if (this != &other) {
+    Cancel(listing);
+    listing = std::move(other.listing);
+  }
+  return *this;
+}
+
+void DirectoryLister::Poll(std::vector<std::string> &out) {
+  if (!listing) {
+    return;
+  }
+
+  std::lock_guard G(listing->lock);
+  if (out.empty()) {
+    out.swap(listing->pending);
+  } else {
+    out.insert(out.end(), std::make_move_iterator(listing->pending.begin()),
+               std::make_move_iterator(listing->pending.end()));
+    listing->pending.clear();
+  }
+}
+
+bool DirectoryLister::IsFinished() const {
+  return !listing || listing->finished;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct DirectoryListing;
+
+// Lists the subdirectories of `root` on a background thread. An empty root
+// lists the logical drives on Windows and `/` elsewhere. Names arrive in
+// batches in no particular order.
+struct DirectoryLister {
+  explicit DirectoryLister(const std::filesystem::path &root);
+  // Doesn't wait for the listing thread; it notices the cancellation after its
+  // current entry, which may take a while on slow mounts
+  ~DirectoryLister();
+
+  DirectoryLister(DirectoryLister &&) = default;
+  DirectoryLister &operator=(DirectoryLister &&);
+
+  // Appends the names found since the last call to `out`; never blocks on the
+  // listing thread for longer than it takes to swap a vector
+  void Poll(std::vector<std::string> &out);
+  bool IsFinished() const;
+
+  std::shared_ptr<DirectoryListing> listing;
+};
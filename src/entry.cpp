@@ -2,51 +2,274 @@
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstring>
 #include <filesystem>
 #include <functional>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
 #include <string>
 #include <thread>
+#include <unordered_set>
 
 #include <fmt/core.h>
 
+#include "arena.hpp"
+#include "budget.hpp"
+#include "cpu.hpp"
 #include "data.hpp"
+#include "decomp.hpp"
 #include "mmap.hpp"
+#include "pathrules.hpp"
 #include "pipe.hpp"
+#include "scan.hpp"
 #include "ui.hpp"
+#include "writeback.hpp"
 
 #include "BTracy.hpp"
 
 enum {
   SIZ_INPUT_BACKLOG = 8,
-};
-
-struct MatchThreadInput {
-  std::string path;
+  // Captured lines are cut off after this many bytes, except for those a
+  // match continues past
+  SIZ_SNIPPET_MAX_LINE = 1024,
+  // Matches spanning more lines than this only have their first lines captured
+  NUM_SNIPPET_MAX_MATCH_LINES = 64,
+  // Files larger than this are split into windows that are searched in
+  // parallel
+  SIZ_LARGE_FILE = 64 * 1024 * 1024,
+  SIZ_WINDOW = 32 * 1024 * 1024,
+  // Each window is mapped with this much of its neighbours on both sides, so
+  // that matches and context lines crossing the boundary can be completed
+  SIZ_WINDOW_OVERLAP = 1024 * 1024,
+  // Compressed files are decompressed into a buffer of this size per worker.
+  // Once it is full, all but the last SIZ_WINDOW_OVERLAP bytes are searched
+  // and the buffer slides forward, keeping another SIZ_WINDOW_OVERLAP bytes
+  // before the unsearched part for context lines.
+  SIZ_STREAM_BUFFER = 8 * 1024 * 1024,
+  // Granularity at which the I/O stage touches mapped pages
+  SIZ_PAGE = 4096,
+  // The I/O stage stops loading once this many inputs per active match thread
+  // are waiting to be searched
+  NUM_LOADED_BACKLOG_PER_THREAD = 4,
+  // How often the pool sizes are reconsidered
+  CONTROLLER_INTERVAL_MS = 50,
+  MAX_IO_THREADS = 64,
+  SIZ_JIT_STACK_MIN = 32 * 1024,
+  SIZ_JIT_STACK_MAX = 1024 * 1024,
+  // A level of directory depth delays a file as much as this many doublings
+  // of its size or age; see GetInputPriority
+  PRIORITY_DEPTH_WEIGHT = 4,
+  // Result rows (file headers and matches) that fill the result pane, for the
+  // time-to-first-screenful metric
+  NUM_ROWS_SCREENFUL = 50,
 };
 
 struct MatchThreadResult {
   std::string path;
   size_t sizContents;
+  int64_t mtime;
   std::vector<Match> matches;
-  std::vector<LineInfo> lineInfo;
+  Arena snippets;
+  // Taken from the memory budget until the result has been published
+  size_t sizBudget = 0;
+  UI_ReplaceOutcome replaceOutcome = UI_ROUntouched;
+  uint64_t numMatchesCounted = 0;
+};
+
+struct WindowResult {
+  // Offsets are absolute, but line indices are relative to the line that
+  // contains the first mapped byte of the window
+  std::vector<Match> matches;
+  Arena snippets;
+  // Newlines between the first mapped byte and the start of the window
+  size_t numNewlinesBefore = 0;
+  // Newlines in [offStart, offEnd) of the window
+  size_t numNewlines = 0;
+};
+
+// A large file being searched by several workers, one window each. The
+// worker finishing the last window stitches the results together.
+struct LargeFileJob {
+  std::string path;
+  uint64_t size;
+  // Taken by the worker of the first window while it is mapped
+  FileIdentity identity;
+  std::vector<WindowResult> windows;
+  std::atomic<uint32_t> numRemaining;
+  std::atomic<bool> failed{false};
+};
+
+struct MatchThreadConstants;
+
+struct MatchThreadInput {
+  // Request the input belongs to
+  MatchThreadConstants *request = nullptr;
+  std::string path;
+  // Only set for windows of large files
+  std::shared_ptr<LargeFileJob> job;
+  uint32_t idxWindow = 0;
+  // Lower is searched first; see GetInputPriority. Ties are broken by
+  // `seq`, the order of enumeration.
+  uint32_t priority = 0;
+  uint64_t seq = 0;
+};
+
+// Heap of inputs with the interface of std::queue, front() being the input
+// that should be searched next
+struct InputQueue {
+  std::vector<std::optional<MatchThreadInput>> heap;
+
+  // Whether `lhs` comes after `rhs`
+  static bool Later(const std::optional<MatchThreadInput> &lhs,
+                    const std::optional<MatchThreadInput> &rhs) {
+    if (lhs->priority != rhs->priority) {
+      return lhs->priority > rhs->priority;
+    }
+    return lhs->seq > rhs->seq;
+  }
+
+  bool empty() const { return heap.empty(); }
+  size_t size() const { return heap.size(); }
+  std::optional<MatchThreadInput> &front() { return heap.front(); }
+  void push(std::optional<MatchThreadInput> &&input) {
+    heap.push_back(std::move(input));
+    std::push_heap(heap.begin(), heap.end(), Later);
+  }
+  // The front may have been moved from, but its sort keys are intact
+  void pop() {
+    std::pop_heap(heap.begin(), heap.end(), Later);
+    heap.pop_back();
+  }
+};
+
+// An input that the I/O stage mapped and paged in. The match stage searches
+// and unloads it.
+struct LoadedInput {
+  MatchThreadInput input;
+  MemoryMapHandle mmap = nullptr;
+  const void *pContents = nullptr;
+  size_t sizContents = 0;
+  // File offset of `pContents`
+  uint64_t offMap = 0;
+  FileIdentity identity;
+  size_t sizBudget = 0;
+};
+
+// Every thread of a pool is started up front, and the ones whose index is at
+// or past `numActive` stay parked. The controller tunes `numActive` unless the
+// size was set by the user.
+struct WorkerPool {
+  uint32_t numThreads = 0;
+  bool adaptive = true;
+  // Written with `lock` held
+  std::atomic<uint32_t> numActive{0};
+  // Threads that haven't exited yet, parked or not
+  std::atomic<uint32_t> numRunning{0};
+  std::mutex lock;
+  std::condition_variable cv;
+};
+
+struct WorkerConfig;
+
+// The I/O and match threads, started once and shared by every request. Each
+// input carries the request it belongs to, so starting a search only takes
+// pushing its inputs.
+struct WorkerThreads {
+  void Start(const WorkerConfig &config);
+  // Processes what is still queued, then joins the threads
+  void Stop();
+
+  // Enumerated files and windows, closed by Stop
+  Pipe<MatchThreadInput, InputQueue> inputs;
+  // Closed by the last I/O thread to exit
+  Pipe<LoadedInput> loaded;
+
+  WorkerPool ioPool;
+  WorkerPool matchPool;
+  // Observed by the controller
+  std::atomic<uint64_t> bytesMatched{0};
+  std::atomic<uint32_t> numMatchIdle{0};
+
+  std::mutex lockController;
+  std::condition_variable cvController;
+  // Guarded by `lockController`. The controller only runs while a request is
+  // being searched.
+  bool busy = false;
+  bool stopController = false;
+
+  std::vector<std::thread> ioThreads;
+  std::vector<std::thread> matchThreads;
+  std::thread controller;
 };
 
 struct MatchRequestStateAndContent {
   UI_MatchRequestState state;
 };
 
+// Replacement text split into literal runs and capture group references
+struct ReplacementTemplate {
+  struct Part {
+    std::string literal;
+    // Capture group inserted after `literal`, or -1
+    int idxGroup = -1;
+  };
+  std::vector<Part> parts;
+};
+
 struct MatchThreadConstants {
+  uint64_t idRequest = 0;
   pcre2_code *pattern = nullptr;
+  // Set when the pattern is a plain literal that the scan kernels can handle
+  // without going through PCRE2
+  std::optional<ScanNeedle> literal;
+  uint32_t numContextBefore = 0;
+  uint32_t numContextAfter = 0;
+  OutputMode outputMode = OUTPUT_MATCHES;
+  bool multiline = false;
   std::atomic<bool> aborted;
-
-  Pipe<MatchThreadInput> inputs;
+  // Matches reported by the whole request and by each file. Workers reserve
+  // the matches of a file from `maxCount` once it has been searched, and
+  // `limitReached` is set once nothing is left, so that the remaining inputs
+  // are dropped.
+  uint64_t maxCount = UINT64_MAX;
+  uint64_t maxCountPerFile = UINT64_MAX;
+  std::atomic<uint64_t> numMatchesReserved{0};
+  std::atomic<bool> limitReached{false};
+
+  // Set in replace mode. Unless `dryRun`, the files are rewritten by the match
+  // threads.
+  std::optional<ReplacementTemplate> replacement;
+  bool dryRun = true;
+  std::atomic<size_t> numFilesWritten{0};
+  std::atomic<size_t> numWriteFailures{0};
+
+  // Inputs that were neither searched nor dropped yet. Workers no longer touch
+  // the request once this dropped to zero.
+  std::atomic<size_t> numPending{0};
   Pipe<MatchThreadResult> results;
+
+  // Whether inputs that haven't been searched yet can be dropped
+  bool IsStopping() const { return aborted || limitReached; }
+};
+
+// State of a match thread that is kept from one request to the next
+struct MatchScratch {
+  // Request that `matchData` was last prepared for
+  uint64_t idRequest = 0;
+  pcre2_match_data *matchData = nullptr;
+  pcre2_match_context *matchContext = nullptr;
+  pcre2_jit_stack *jitStack = nullptr;
+  // Decompression buffer, allocated on the first compressed file
+  std::vector<char> streamBuffer;
+  // Expansion of the replacement template for the current match
+  std::string replacement;
 };
 
 static int pcre2_match_w(pcre2_code_8 *code,
@@ -54,205 +277,1301 @@ static int pcre2_match_w(pcre2_code_8 *code,
                          size_t size,
                          size_t offset,
                          unsigned flags,
-                         pcre2_match_data_8 *matchData) {
+                         pcre2_match_data_8 *matchData,
+                         pcre2_match_context_8 *matchContext) {
   ZoneScoped;
   return pcre2_match(code, (PCRE2_SPTR8)contents, size, offset, flags,
-                     matchData, nullptr);
+                     matchData, matchContext);
+}
+
+// Options for searching a buffer that may start or end in the middle of a
+// file. In multiline mode, ^ and $ can match at the start and end of the
+// buffer only if those are the start and end of the file.
+static uint32_t GetMatchOptions(const MatchThreadConstants *constants,
+                                bool atFileStart,
+                                bool atFileEnd) {
+  if (!constants->multiline) {
+    return PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NOTEMPTY;
+  }
+
+  uint32_t ret = PCRE2_NOTEMPTY;
+  if (!atFileStart) {
+    ret |= PCRE2_NOTBOL;
+  }
+  if (!atFileEnd) {
+    ret |= PCRE2_NOTEOL;
+  }
+  return ret;
+}
+
+// `options` come from GetMatchOptions; literal patterns ignore them
+static int FindNextMatch(const MatchThreadConstants *constants,
+                         const void *contents,
+                         size_t size,
+                         size_t offset,
+                         uint32_t options,
+                         MatchScratch &scratch,
+                         size_t &offStart,
+                         size_t &offEnd) {
+  if (constants->literal) {
+    auto offFound = Scan_Find(*constants->literal, contents, size, offset);
+    if (offFound == SCAN_NPOS) {
+      return PCRE2_ERROR_NOMATCH;
+    }
+
+    offStart = offFound;
+    offEnd = offFound + constants->literal->bytes.size();
+    return 1;
+  }
+
+  auto rc = pcre2_match_w(constants->pattern, contents, size, offset, options,
+                          scratch.matchData, scratch.matchContext);
+  if (rc >= 0) {
+    auto ovector = pcre2_get_ovector_pointer(scratch.matchData);
+    offStart = ovector[0];
+    offEnd = ovector[1];
+  }
+
+  return rc;
 }
 
-static void threadprocMatch(MatchThreadConstants *constants, uint32_t id) {
+// Copies the matching lines and their context lines into `arena`, so that the
+// UI never has to go back to the file
+static void CaptureSnippet(Match &m,
+                           Arena &arena,
+                           const MatchThreadConstants *constants,
+                           const void *contents,
+                           const std::vector<LineInfo> &lineInfos) {
   ZoneScoped;
-  bool shutdown = false;
-  auto threadName = fmt::format("Thread-Match#{}", id);
-  tracy::SetThreadName(threadName.c_str());
+  auto *pContents = (const char *)contents;
+  size_t idxFirstLine = m.idxLine >= constants->numContextBefore
+                            ? m.idxLine - constants->numContextBefore
+                            : 0;
+  size_t idxLastMatchLine =
+      std::min(m.idxLineEnd, m.idxLine + NUM_SNIPPET_MAX_MATCH_LINES - 1);
+  size_t idxLastLine = std::min(idxLastMatchLine + constants->numContextAfter,
+                                lineInfos.size() - 1);
+
+  auto lineLength = [&](size_t idxLine) {
+    auto &line = lineInfos[idxLine];
+    size_t len = line.offEnd - line.offStart;
+    // Lines that the match continues past are kept whole, '\r' (as a space)
+    // included, so that offsets from the start of the match's first line stay
+    // valid. Past the first one, the match covers them completely, so they
+    // are no longer than the match.
+    bool inMatch = idxLine >= m.idxLine && idxLine < idxLastMatchLine;
+    if (inMatch) {
+      return len;
+    }
+    if (len > 0 && pContents[line.offEnd - 1] == '\r') {
+      len--;
+    }
+    return std::min(len, (size_t)SIZ_SNIPPET_MAX_LINE);
+  };
+
+  size_t sizSnippet = 0;
+  for (size_t idxLine = idxFirstLine; idxLine <= idxLastLine; idxLine++) {
+    sizSnippet += lineLength(idxLine) + 1;
+  }
 
-  std::queue<std::optional<MatchThreadInput>> localInputQueue;
+  auto *snippet = arena.AllocArray<char>(sizSnippet);
+  size_t offCursor = 0;
+  for (size_t idxLine = idxFirstLine; idxLine <= idxLastLine; idxLine++) {
+    auto len = lineLength(idxLine);
+    if (idxLine == m.idxLine) {
+      m.offSnippetLine = offCursor;
+    }
+    if (idxLine == idxLastMatchLine) {
+      m.lenSnippetLine = offCursor + len - m.offSnippetLine;
+    }
+
+    auto *src = pContents + lineInfos[idxLine].offStart;
+    for (size_t i = 0; i < len; i++) {
+      auto c = src[i];
+      snippet[offCursor++] = (c == '\r' || c == '\0') ? ' ' : c;
+    }
+    snippet[offCursor++] = '\n';
+  }
+
+  // Replace the last newline
+  snippet[offCursor - 1] = '\0';
+
+  m.snippet = snippet;
+  m.lenSnippet = offCursor - 1;
+  m.idxSnippetFirstLine = idxFirstLine;
+}
 
-  while (!shutdown) {
-    ZoneScopedN("MapFileAndMatch");
+// Parses $n, ${n}, ${name} and $$ in `text`. A '$' followed by anything else
+// is taken literally. Returns false if a group doesn't exist in `pattern`,
+// which is null for literal patterns that only have group 0.
+static bool ParseReplacement(ReplacementTemplate &out,
+                             const std::string &text,
+                             const pcre2_code *pattern) {
+  uint32_t numCaptures = 0;
+  if (pattern != nullptr) {
+    pcre2_pattern_info(pattern, PCRE2_INFO_CAPTURECOUNT, &numCaptures);
+  }
+
+  auto parseNumber = [](int &idxGroup, const std::string &digits) {
+    if (digits.empty() || digits.size() > 5 ||
+        digits.find_first_not_of("0123456789") != std::string::npos) {
+      return false;
+    }
+    idxGroup = std::stoi(digits);
+    return true;
+  };
+
+  ReplacementTemplate::Part part;
+  size_t idx = 0;
+  while (idx < text.size()) {
+    if (text[idx] != '$' || idx + 1 == text.size()) {
+      part.literal += text[idx++];
+      continue;
+    }
 
-    if (localInputQueue.empty()) {
-      ZoneScopedN("Fetch input");
-      auto L = constants->inputs.lock();
-      while (constants->inputs.empty()) {
-        constants->inputs.wait(L);
+    auto c = text[idx + 1];
+    int idxGroup = -1;
+    if (c == '$') {
+      part.literal += '$';
+      idx += 2;
+      continue;
+    } else if (isdigit((unsigned char)c)) {
+      auto offEnd = text.find_first_not_of("0123456789", idx + 1);
+      if (offEnd == std::string::npos) {
+        offEnd = text.size();
+      }
+      if (!parseNumber(idxGroup, text.substr(idx + 1, offEnd - idx - 1))) {
+        return false;
+      }
+      idx = offEnd;
+    } else if (c == '{') {
+      auto offClose = text.find('}', idx + 2);
+      if (offClose == std::string::npos) {
+        return false;
+      }
+      auto name = text.substr(idx + 2, offClose - idx - 2);
+      if (!parseNumber(idxGroup, name)) {
+        if (pattern == nullptr) {
+          return false;
+        }
+        idxGroup = pcre2_substring_number_from_name(pattern,
+                                                    (PCRE2_SPTR8)name.c_str());
+        if (idxGroup < 0) {
+          return false;
+        }
       }
+      idx = offClose + 1;
+    } else {
+      part.literal += text[idx++];
+      continue;
+    }
+
+    if ((uint32_t)idxGroup > numCaptures) {
+      return false;
+    }
+    part.idxGroup = idxGroup;
+    out.parts.push_back(std::move(part));
+    part = {};
+  }
+
+  if (!part.literal.empty()) {
+    out.parts.push_back(std::move(part));
+  }
+  return true;
+}
 
-      while (localInputQueue.size() < 2 && !constants->inputs.empty()) {
-        auto &input = constants->inputs.front();
-        auto hasValue = input.has_value();
-        localInputQueue.push(std::move(input));
-        constants->inputs.pop();
-        if (!hasValue) {
-          // Found shutdown signal in shared queue
+// Appends the replacement of the match at [offStart, offEnd) to `out`.
+// `ovector` holds the captures of the match, or is null for literal patterns.
+static void ExpandReplacement(std::string &out,
+                              const ReplacementTemplate &replacement,
+                              const void *contents,
+                              const PCRE2_SIZE *ovector,
+                              size_t offStart,
+                              size_t offEnd) {
+  auto *pChars = (const char *)contents;
+  for (auto &part : replacement.parts) {
+    out += part.literal;
+    if (part.idxGroup < 0) {
+      continue;
+    }
+
+    size_t offGroupStart = offStart, offGroupEnd = offEnd;
+    if (ovector != nullptr) {
+      offGroupStart = ovector[2 * part.idxGroup];
+      offGroupEnd = ovector[2 * part.idxGroup + 1];
+    }
+    // Groups that didn't participate in the match expand to nothing
+    if (offGroupStart != PCRE2_UNSET) {
+      out.append(pChars + offGroupStart, offGroupEnd - offGroupStart);
+    }
+  }
+}
+
+// Collects the matches starting in [offSearchBegin, offSearchEnd) of
+// `contents`; they may extend up to `size`. Stops after `maxMatches` or once
+// the request's match limit was reached. Offsets and line indices are
+// relative to `contents`. In replace mode every match also gets its
+// replacement. Returns false if the request was aborted.
+static bool MatchBuffer(const MatchThreadConstants *constants,
+                        const void *contents,
+                        size_t size,
+                        size_t offSearchBegin,
+                        size_t offSearchEnd,
+                        uint32_t options,
+                        MatchScratch &scratch,
+                        uint64_t maxMatches,
+                        std::vector<Match> &matches,
+                        Arena &snippets) {
+  ZoneScoped;
+  size_t offset = offSearchBegin;
+  size_t numMatchesBefore = matches.size();
+  int rc;
+  std::vector<LineInfo> lineInfos;
+  size_t sizLineInfos = 0;
+  bool ok = true;
+
+  do {
+    if (matches.size() - numMatchesBefore >= maxMatches ||
+        constants->limitReached) {
+      break;
+    }
+
+    size_t offMatchStart = 0, offMatchEnd = 0;
+    rc = FindNextMatch(constants, contents, size, offset, options, scratch,
+                       offMatchStart, offMatchEnd);
+    if (rc < 0) {
+      switch (rc) {
+        case PCRE2_ERROR_NOMATCH:
           break;
+        default:
+          fmt::print("Match error {}\n", rc);
+          break;
+      }
+    } else if (offMatchStart >= offSearchEnd) {
+      // Belongs to the next window
+      break;
+    } else {
+      if (lineInfos.empty()) {
+        ZoneScopedN("Compute line info");
+        // memchr skips whole vectors of bytes that contain no newline
+        auto *pChars = (const char *)contents;
+        LineInfo currentLine;
+        currentLine.offStart = 0;
+
+        while (true) {
+          auto *pNewline = (const char *)memchr(
+              pChars + currentLine.offStart, '\n', size - currentLine.offStart);
+          if (pNewline == nullptr) {
+            break;
+          }
+          currentLine.offEnd = pNewline - pChars;
+          lineInfos.push_back(currentLine);
+          currentLine.offStart = currentLine.offEnd + 1;
+        }
+
+        // Last line
+        currentLine.offEnd = size;
+        lineInfos.push_back(currentLine);
+
+        sizLineInfos = lineInfos.capacity() * sizeof(LineInfo);
+        Budget_Charge(sizLineInfos);
+      }
+
+      if (constants->aborted) {
+        ok = false;
+        break;
+      }
+
+      Match m = {};
+      m.offStart = offMatchStart;
+      m.offEnd = offMatchEnd;
+
+      {
+        ZoneScopedN("LookupLineIndex");
+        // Lookup line index by binary search: the match is on the last
+        // line that starts at or before it
+        auto it = std::upper_bound(lineInfos.begin(), lineInfos.end(),
+                                   m.offStart,
+                                   [](size_t off, const LineInfo &line) {
+                                     return off < line.offStart;
+                                   });
+        assert(it != lineInfos.begin());
+        m.idxLine = std::distance(lineInfos.begin(), it) - 1;
+        m.idxColumn = m.offStart - lineInfos[m.idxLine].offStart;
+
+        // A match that crosses the end of its line ends on the line holding
+        // its last byte, which is found the same way
+        m.idxLineEnd = m.idxLine;
+        if (m.offEnd > lineInfos[m.idxLine].offEnd) {
+          auto itEnd = std::upper_bound(it, lineInfos.end(), m.offEnd - 1,
+                                        [](size_t off, const LineInfo &line) {
+                                          return off < line.offStart;
+                                        });
+          m.idxLineEnd = std::distance(lineInfos.begin(), itEnd) - 1;
         }
       }
+
+      if (!matches.empty() && matches.back().idxLine == m.idxLine &&
+          matches.back().idxLineEnd == m.idxLineEnd) {
+        // Same lines as the previous match, share its snippet
+        auto &prev = matches.back();
+        m.snippet = prev.snippet;
+        m.lenSnippet = prev.lenSnippet;
+        m.idxSnippetFirstLine = prev.idxSnippetFirstLine;
+        m.offSnippetLine = prev.offSnippetLine;
+        m.lenSnippetLine = prev.lenSnippetLine;
+      } else {
+        CaptureSnippet(m, snippets, constants, contents, lineInfos);
+      }
+
+      if (constants->replacement) {
+        // The ovector still belongs to this match
+        const PCRE2_SIZE *ovector =
+            constants->literal ? nullptr
+                               : pcre2_get_ovector_pointer(scratch.matchData);
+        scratch.replacement.clear();
+        ExpandReplacement(scratch.replacement, *constants->replacement,
+                          contents, ovector, offMatchStart, offMatchEnd);
+        m.replacement = snippets.CopyString(scratch.replacement.data(),
+                                            scratch.replacement.size());
+        m.lenReplacement = scratch.replacement.size();
+      }
+
+      if (!constants->literal && rc > 1) {
+        // Kept as offsets into the line, so that no group is copied
+        auto ovector = pcre2_get_ovector_pointer(scratch.matchData);
+        auto offLine = lineInfos[m.idxLine].offStart;
+        auto toLineOffset = [&](PCRE2_SIZE off) {
+          if (off < offLine) {
+            // Lookbehinds can reach into the lines before
+            return 0u;
+          }
+          return (uint32_t)std::min<size_t>(off - offLine,
+                                            MATCH_GROUP_UNSET - 1);
+        };
+
+        auto *groups = snippets.AllocArray<MatchGroup>(rc - 1);
+        for (int i = 1; i < rc; i++) {
+          if (ovector[2 * i] == PCRE2_UNSET) {
+            groups[i - 1] = {MATCH_GROUP_UNSET, MATCH_GROUP_UNSET};
+          } else {
+            groups[i - 1] = {toLineOffset(ovector[2 * i]),
+                             toLineOffset(ovector[2 * i + 1])};
+          }
+        }
+        m.groups = groups;
+        m.numGroups = rc - 1;
+      }
+
+      assert(m.idxLine < lineInfos.size());
+      assert(m.offStart < size);
+      assert(m.offEnd <= size);
+      matches.push_back(m);
+
+      offset = offMatchEnd;
     }
 
-    if (shutdown) {
+    if (constants->aborted) {
+      ok = false;
       break;
     }
+  } while (rc > 0);
 
-    auto input = std::move(localInputQueue.front());
-    localInputQueue.pop();
+  Budget_Release(sizLineInfos);
+  return ok;
+}
 
-    if (!input || constants->aborted) {
-      shutdown = true;
+// Counts the matches starting in [offSearchBegin, offSearchEnd) of `contents`
+// into `count`, stopping once it reaches `limit` or the request's match limit
+// was reached. Unlike MatchBuffer, lines are never looked at.
+// `offLastMatchEnd` is set to the end of the last match counted. Returns false
+// if the request was aborted.
+static bool CountBuffer(const MatchThreadConstants *constants,
+                        const void *contents,
+                        size_t size,
+                        size_t offSearchBegin,
+                        size_t offSearchEnd,
+                        uint32_t options,
+                        MatchScratch &scratch,
+                        uint64_t limit,
+                        uint64_t &count,
+                        size_t &offLastMatchEnd) {
+  ZoneScoped;
+  size_t offset = offSearchBegin;
+  while (count < limit && !constants->limitReached) {
+    size_t offMatchStart = 0, offMatchEnd = 0;
+    auto rc = FindNextMatch(constants, contents, size, offset, options,
+                            scratch, offMatchStart, offMatchEnd);
+    if (rc < 0) {
+      if (rc != PCRE2_ERROR_NOMATCH) {
+        fmt::print("Match error {}\n", rc);
+      }
+      break;
+    }
+    if (offMatchStart >= offSearchEnd) {
       break;
     }
 
-    std::error_code error;
-    MemoryMapHandle mmap;
-    auto mmapRc = Mmap_Open(mmap, input->path);
+    count++;
+    offLastMatchEnd = offMatchEnd;
+    offset = offMatchEnd;
+    if (constants->aborted) {
+      return false;
+    }
+  }
+  return !constants->aborted;
+}
 
-    if (mmapRc != Mmap_OK) {
-      continue;
+// Matches a file may report: its own limit, or what is left of the request's
+// if that is less
+static uint64_t GetMatchLimit(const MatchThreadConstants *constants) {
+  uint64_t numReserved = constants->numMatchesReserved;
+  uint64_t numLeft =
+      numReserved < constants->maxCount ? constants->maxCount - numReserved : 0;
+  return std::min(constants->maxCountPerFile, numLeft);
+}
+
+// Matches needed before a file's result is known in the list and count modes.
+// Files without a match don't take from the request's limit.
+static uint64_t GetCountLimit(const MatchThreadConstants *constants) {
+  switch (constants->outputMode) {
+    case OUTPUT_FILES_WITH_MATCHES:
+      return std::min<uint64_t>(1, GetMatchLimit(constants));
+    case OUTPUT_FILES_WITHOUT_MATCH:
+      return 1;
+    default:
+      return GetMatchLimit(constants);
+  }
+}
+
+// Takes `num` matches of a searched file from the request's limit and returns
+// how many of them may be reported
+static uint64_t ReserveMatches(MatchThreadConstants *constants, uint64_t num) {
+  if (constants->maxCount == UINT64_MAX) {
+    return num;
+  }
+
+  uint64_t numBefore = constants->numMatchesReserved.fetch_add(num);
+  if (numBefore + num >= constants->maxCount) {
+    constants->limitReached = true;
+  }
+  if (numBefore >= constants->maxCount) {
+    return 0;
+  }
+  return std::min(num, constants->maxCount - numBefore);
+}
+
+// Writes `contents` with every match replaced by its replacement to `out`
+static void ApplyReplacements(std::string &out,
+                              const void *contents,
+                              size_t size,
+                              const std::vector<Match> &matches) {
+  ZoneScoped;
+  auto *pChars = (const char *)contents;
+  size_t offCopied = 0;
+  for (auto &match : matches) {
+    out.append(pChars + offCopied, match.offStart - offCopied);
+    out.append(match.replacement, match.lenReplacement);
+    offCopied = match.offEnd;
+  }
+  out.append(pChars + offCopied, size - offCopied);
+}
+
+static void PushResult(MatchThreadConstants *constants,
+                       MatchThreadResult &&result) {
+  ZoneScopedN("Pushing results");
+  // Pending results don't wait for the budget: they're already allocated and
+  // holding them back would only delay publishing them
+  result.sizBudget = result.matches.capacity() * sizeof(Match) +
+                     result.snippets.GetCapacity();
+  Budget_Charge(result.sizBudget);
+  auto L = constants->results.lock();
+  constants->results.push(std::move(result));
+  constants->results.notify_one();
+}
+
+// Marks an input as searched or dropped. The last one is taken off under the
+// results lock and wakes the main thread, which may then free `constants`.
+static void FinishInput(MatchThreadConstants *constants) {
+  auto numPending = constants->numPending.load();
+  while (numPending > 1) {
+    if (constants->numPending.compare_exchange_weak(numPending,
+                                                    numPending - 1)) {
+      return;
     }
+  }
+  auto L = constants->results.lock();
+  if (--constants->numPending == 0) {
+    constants->results.notify_all();
+  }
+}
 
-    const void *pContents;
-    size_t sizContents;
-    mmapRc = Mmap_Map(pContents, sizContents, mmap);
+// Maps [offset, offset + len) of `path`, or all of it if `len` is 0, and takes
+// the mapped size from the memory budget. Without `canWait` the budget is
+// taken even if it is exhausted. Returns false if the file couldn't be mapped
+// or the request was aborted while waiting.
+static bool LoadInput(const MatchThreadConstants *constants,
+                      LoadedInput &out,
+                      const std::string &path,
+                      uint64_t offset,
+                      uint64_t len,
+                      bool canWait) {
+  ZoneScoped;
+  if (Mmap_Open(out.mmap, path) != Mmap_OK) {
+    return false;
+  }
+  Mmap_GetIdentity(out.identity, out.mmap);
+
+  out.sizBudget = len != 0 ? len : out.identity.size;
+  if (!canWait) {
+    Budget_Charge(out.sizBudget);
+  } else if (!Budget_Acquire(out.sizBudget, constants->aborted)) {
+    Mmap_Close(out.mmap);
+    return false;
+  }
 
-    if (mmapRc != Mmap_OK) {
-      continue;
+  if (Mmap_Map(out.pContents, out.sizContents, out.mmap, offset, len) !=
+      Mmap_OK) {
+    Budget_Release(out.sizBudget);
+    Mmap_Close(out.mmap);
+    return false;
+  }
+
+  out.offMap = offset;
+  return true;
+}
+
+static void UnloadInput(LoadedInput &loaded) {
+  Mmap_Unmap(loaded.mmap, loaded.pContents);
+  Budget_Release(loaded.sizBudget);
+  Mmap_Close(loaded.mmap);
+  loaded.pContents = nullptr;
+}
+
+// Reads a byte from every page, so that the match stage doesn't stall on page
+// faults
+static void Prefault(const void *contents, size_t size) {
+  ZoneScoped;
+  auto *pBytes = (const volatile uint8_t *)contents;
+  uint8_t sum = 0;
+  for (size_t off = 0; off < size; off += SIZ_PAGE) {
+    sum += pBytes[off];
+  }
+  (void)sum;
+}
+
+// Window `idxWindow` covers [offStart, offEnd) of the file and is mapped with
+// its overlap as [offMapStart, offMapEnd)
+static void GetWindowRange(const LargeFileJob &job,
+                           uint32_t idxWindow,
+                           uint64_t &offStart,
+                           uint64_t &offEnd,
+                           uint64_t &offMapStart,
+                           uint64_t &offMapEnd) {
+  offStart = (uint64_t)idxWindow * SIZ_WINDOW;
+  offEnd = std::min(offStart + SIZ_WINDOW, job.size);
+  offMapStart = offStart - std::min<uint64_t>(offStart, SIZ_WINDOW_OVERLAP);
+  offMapEnd = std::min(offEnd + SIZ_WINDOW_OVERLAP, job.size);
+}
+
+// Searches window `idxWindow` of a large file, loaded into `loaded`, for
+// matches starting in [offSearchBegin, end of the window). Returns false if
+// the request was aborted.
+static bool SearchWindow(const MatchThreadConstants *constants,
+                         const LargeFileJob &job,
+                         uint32_t idxWindow,
+                         const LoadedInput &loaded,
+                         uint64_t offSearchBegin,
+                         MatchScratch &scratch,
+                         WindowResult &window) {
+  ZoneScoped;
+  ZoneText(job.path.c_str(), job.path.size());
+  uint64_t offStart, offEnd, offMapStart, offMapEnd;
+  GetWindowRange(job, idxWindow, offStart, offEnd, offMapStart, offMapEnd);
+  assert(loaded.offMap == offMapStart);
+
+  auto *pChars = (const char *)loaded.pContents;
+  auto offWindowStart = offStart - offMapStart;
+  auto offWindowEnd = offEnd - offMapStart;
+  window.numNewlinesBefore = std::count(pChars, pChars + offWindowStart, '\n');
+  window.numNewlines =
+      std::count(pChars + offWindowStart, pChars + offWindowEnd, '\n');
+
+  window.matches.clear();
+  bool ok = true;
+  if (offSearchBegin < offEnd) {
+    // Stitching keeps the first matches of the file, which are all in the
+    // windows before the first one to stop at the limit
+    auto options =
+        GetMatchOptions(constants, offMapStart == 0, offMapEnd == job.size);
+    ok = MatchBuffer(constants, loaded.pContents, loaded.sizContents,
+                     offSearchBegin - offMapStart, offWindowEnd, options,
+                     scratch, GetMatchLimit(constants), window.matches,
+                     window.snippets);
+  }
+  for (auto &match : window.matches) {
+    match.offStart += offMapStart;
+    match.offEnd += offMapStart;
+  }
+
+  return ok;
+}
+
+// Searches a loaded window of a large file and, if it was the last one to
+// finish, publishes the results of the whole file
+static void MatchWindow(MatchThreadConstants *constants,
+                        LoadedInput &loaded,
+                        MatchScratch &scratch) {
+  ZoneScoped;
+  auto &job = *loaded.input.job;
+  auto idxWindow = loaded.input.idxWindow;
+  if (idxWindow == 0) {
+    // Read by the worker that stitches, once `numRemaining` dropped to zero
+    job.identity = loaded.identity;
+  }
+  if (!job.failed && !constants->limitReached) {
+    uint64_t offStart = (uint64_t)idxWindow * SIZ_WINDOW;
+    if (!SearchWindow(constants, job, idxWindow, loaded, offStart, scratch,
+                      job.windows[idxWindow])) {
+      job.failed = true;
+    }
+  }
+  UnloadInput(loaded);
+
+  if (--job.numRemaining != 0 || job.failed) {
+    return;
+  }
+
+  ZoneScopedN("Stitch windows");
+  MatchThreadResult result;
+  result.path = job.path;
+  result.sizContents = job.size;
+  result.mtime = job.identity.mtime;
+
+  // Line indices of each window are made absolute by adding the newlines of
+  // the windows before it
+  size_t numNewlinesBeforeWindow = 0;
+  uint64_t offLastMatchEnd = 0;
+  for (uint32_t idxWindow = 0; idxWindow < job.windows.size(); idxWindow++) {
+    auto &window = job.windows[idxWindow];
+    uint64_t offStart, offEnd, offMapStart, offMapEnd;
+    GetWindowRange(job, idxWindow, offStart, offEnd, offMapStart, offMapEnd);
+    if (offLastMatchEnd > offStart) {
+      // The last match of the previous window extends into this one. A
+      // sequential search would have resumed after it, which may lead to
+      // different matches than a search from the start of the window, so the
+      // window is searched again from there. This only happens for matches
+      // that cross window boundaries.
+      ZoneScopedN("Search again");
+      window.snippets.Reset();
+      // Waiting for the budget here could deadlock with the I/O stage
+      LoadedInput again;
+      if (!LoadInput(constants, again, job.path, offMapStart,
+                     offMapEnd - offMapStart, false)) {
+        return;
+      }
+      auto ok = SearchWindow(constants, job, idxWindow, again, offLastMatchEnd,
+                             scratch, window);
+      UnloadInput(again);
+      if (!ok) {
+        return;
+      }
+    }
+
+    size_t idxLineBase = numNewlinesBeforeWindow - window.numNewlinesBefore;
+    for (auto &match : window.matches) {
+      assert(match.offStart >= offLastMatchEnd);
+      match.idxLine += idxLineBase;
+      match.idxLineEnd += idxLineBase;
+      match.idxSnippetFirstLine += idxLineBase;
+      result.matches.push_back(match);
+      offLastMatchEnd = match.offEnd;
+    }
+    numNewlinesBeforeWindow += window.numNewlines;
+    result.snippets.Merge(std::move(window.snippets));
+  }
+
+  auto numMatches =
+      std::min<uint64_t>(result.matches.size(), constants->maxCountPerFile);
+  result.matches.resize(ReserveMatches(constants, numMatches));
+  if (!result.matches.empty()) {
+    PushResult(constants, std::move(result));
+  }
+}
+
+// Searches a compressed file as it is being decompressed, without ever
+// holding more than SIZ_STREAM_BUFFER bytes of it. Offsets and line indices
+// are relative to the decompressed stream. Returns false if the request was
+// aborted.
+//
+// Outside of OUTPUT_MATCHES, the matches are only counted into `numCounted`.
+// Decompression stops once the file has as many matches as it may report, in
+// which case `sizStream` only covers what was decompressed.
+static bool MatchStream(const MatchThreadConstants *constants,
+                        DecompressorHandle decomp,
+                        MatchScratch &scratch,
+                        size_t &sizStream,
+                        std::vector<Match> &matches,
+                        Arena &snippets,
+                        uint64_t &numCounted) {
+  ZoneScoped;
+  static_assert(SIZ_STREAM_BUFFER > 4 * SIZ_WINDOW_OVERLAP);
+  auto &buffer = scratch.streamBuffer;
+  buffer.resize(SIZ_STREAM_BUFFER);
+  // Only counted while in use; the buffer is kept for the next compressed file
+  Budget_Charge(SIZ_STREAM_BUFFER);
+
+  // Stream offset and line index of the first byte of the buffer
+  size_t offBuffer = 0;
+  size_t idxLineBuffer = 0;
+  size_t lenBuffer = 0;
+  size_t offSearch = 0;
+  bool endOfStream = false;
+  std::vector<Match> bufferMatches;
+  auto limit = constants->outputMode == OUTPUT_MATCHES
+                   ? GetMatchLimit(constants)
+                   : GetCountLimit(constants);
+
+  while (true) {
+    {
+      ZoneScopedN("Decompress");
+      while (!endOfStream && lenBuffer < buffer.size()) {
+        size_t lenRead = 0;
+        auto rc = Decomp_Read(decomp, buffer.data() + lenBuffer,
+                              buffer.size() - lenBuffer, lenRead);
+        // Truncated and corrupt streams are searched as far as they could be
+        // decompressed
+        endOfStream = rc != Decomp_OK;
+        lenBuffer += lenRead;
+      }
+    }
+
+    auto offSearchEnd =
+        endOfStream ? lenBuffer : lenBuffer - SIZ_WINDOW_OVERLAP;
+    bufferMatches.clear();
+    // Relative to the buffer, or 0 if there was no match
+    size_t offLastMatchEnd = 0;
+    if (offSearch < offSearchEnd) {
+      auto options = GetMatchOptions(constants, offBuffer == 0, endOfStream);
+      bool ok;
+      if (constants->outputMode != OUTPUT_MATCHES) {
+        ok = CountBuffer(constants, buffer.data(), lenBuffer, offSearch,
+                         offSearchEnd, options, scratch, limit, numCounted,
+                         offLastMatchEnd);
+      } else {
+        ok = MatchBuffer(constants, buffer.data(), lenBuffer, offSearch,
+                         offSearchEnd, options, scratch,
+                         limit - matches.size(), bufferMatches, snippets);
+        if (!bufferMatches.empty()) {
+          offLastMatchEnd = bufferMatches.back().offEnd;
+        }
+      }
+      if (!ok) {
+        Budget_Release(SIZ_STREAM_BUFFER);
+        return false;
+      }
+    }
+
+    for (auto &match : bufferMatches) {
+      match.offStart += offBuffer;
+      match.offEnd += offBuffer;
+      match.idxLine += idxLineBuffer;
+      match.idxLineEnd += idxLineBuffer;
+      match.idxSnippetFirstLine += idxLineBuffer;
+      matches.push_back(match);
+    }
+
+    if (endOfStream || matches.size() + numCounted >= limit ||
+        constants->limitReached) {
+      break;
+    }
+
+    // A sequential search would continue after the last match, even if that
+    // crossed into the unsearched part
+    offSearch = std::max(offSearchEnd, offLastMatchEnd);
+
+    auto offKeep = offSearchEnd - SIZ_WINDOW_OVERLAP;
+    idxLineBuffer += std::count(buffer.data(), buffer.data() + offKeep, '\n');
+    memmove(buffer.data(), buffer.data() + offKeep, lenBuffer - offKeep);
+    offBuffer += offKeep;
+    lenBuffer -= offKeep;
+    offSearch -= offKeep;
+  }
+
+  Budget_Release(SIZ_STREAM_BUFFER);
+  sizStream = offBuffer + lenBuffer;
+  return true;
+}
+
+// Parks thread `idxThread` while the pool is shrunk below it
+static void WaitUntilActive(WorkerPool &pool, uint32_t idxThread) {
+  if (idxThread < pool.numActive) {
+    return;
+  }
+
+  ZoneScopedN("Parked");
+  std::unique_lock L(pool.lock);
+  pool.cv.wait(L, [&]() { return idxThread < pool.numActive; });
+}
+
+// Pops the next item of `pipe`. Returns false once it is closed and drained.
+template <typename T, typename Queue>
+static bool Fetch(Pipe<T, Queue> &pipe, T &out) {
+  ZoneScoped;
+  auto L = pipe.lock();
+  while (pipe.empty() && !pipe.closed) {
+    pipe.wait(L);
+  }
+  if (pipe.empty()) {
+    return false;
+  }
+
+  out = std::move(*pipe.front());
+  pipe.pop();
+  // Producers may be waiting for room
+  pipe.notify_all();
+  return true;
+}
+
+static void threadprocIo(WorkerThreads *workers, uint32_t id) {
+  ZoneScoped;
+  auto threadName = fmt::format("Thread-IO#{}", id);
+  tracy::SetThreadName(threadName.c_str());
+
+  while (true) {
+    WaitUntilActive(workers->ioPool, id);
+    MatchThreadInput input;
+    if (!Fetch(workers->inputs, input)) {
+      break;
     }
 
-    if (sizContents > 100 * 1024 * 1024) {
-      Mmap_Close(mmap);
+    auto *constants = input.request;
+    if (constants->IsStopping()) {
+      FinishInput(constants);
       continue;
     }
 
-    auto *matchData =
-        pcre2_match_data_create_from_pattern(constants->pattern, nullptr);
-    size_t offset = 0;
-    int rc;
-    std::vector<Match> matches;
+    LoadedInput loaded;
+    bool ok;
+    if (input.job) {
+      uint64_t offStart, offEnd, offMapStart, offMapEnd;
+      GetWindowRange(*input.job, input.idxWindow, offStart, offEnd,
+                     offMapStart, offMapEnd);
+      ok = LoadInput(constants, loaded, input.path, offMapStart,
+                     offMapEnd - offMapStart, true);
+      if (!ok) {
+        input.job->failed = true;
+        input.job->numRemaining--;
+      }
+    } else {
+      ok = LoadInput(constants, loaded, input.path, 0, 0, true);
+    }
 
-    std::vector<LineInfo> lineInfos;
+    if (!ok) {
+      FinishInput(constants);
+      continue;
+    }
 
     {
-      ZoneScopedN("Match loop");
-      ZoneText(input->path.c_str(), input->path.size());
-      do {
-        rc = pcre2_match_w(constants->pattern, pContents, sizContents, offset,
-                           PCRE2_NOTBOL | PCRE2_NOTEOL | PCRE2_NOTEMPTY,
-                           matchData);
-        if (rc < 0) {
-          switch (rc) {
-            case PCRE2_ERROR_NOMATCH:
-              break;
-            default:
-              fmt::print("Match error {}\n", rc);
-              break;
-          }
-        } else {
-          if (lineInfos.empty()) {
-            ZoneScopedN("Compute line info");
-            size_t offCursor = 0;
-            const size_t offEnd = sizContents;
-
-            LineInfo currentLine;
-            currentLine.offStart = offCursor;
-
-            while (offCursor != offEnd) {
-              if (((const uint8_t *)pContents)[offCursor] == '\n') {
-                currentLine.offEnd = offCursor;
-                lineInfos.push_back(currentLine);
-                currentLine.offStart = offCursor + 1;
-              }
-
-              offCursor += 1;
-            }
+      ZoneScopedN("Page in");
+      ZoneText(input.path.c_str(), input.path.size());
+      Prefault(loaded.pContents, loaded.sizContents);
+    }
+    loaded.input = std::move(input);
 
-            // Last line
-            currentLine.offEnd = offEnd;
-            lineInfos.push_back(currentLine);
-          }
+    auto L = workers->loaded.lock();
+    {
+      // Woken by Fetch after every pop; the match threads keep draining the
+      // queue, also once the request is stopping
+      ZoneScopedN("Wait for match stage");
+      workers->loaded.wait(L, [&]() {
+        return workers->loaded.size() < NUM_LOADED_BACKLOG_PER_THREAD *
+                                            workers->matchPool.numActive ||
+               workers->loaded.closed || constants->IsStopping();
+      });
+    }
+    workers->loaded.push(std::move(loaded));
+    workers->loaded.notify_all();
+  }
 
-          auto ovector = pcre2_get_ovector_pointer(matchData);
+  if (--workers->ioPool.numRunning == 0) {
+    auto L = workers->loaded.lock();
+    workers->loaded.closed = true;
+    workers->loaded.notify_all();
+  }
+}
 
-          if (constants->aborted) {
-            shutdown = true;
-            break;
-          }
+// Makes sure that the match data of `scratch` can hold the captures of the
+// pattern of `constants`. Everything else is kept from earlier requests.
+static void PrepareScratch(MatchScratch &scratch,
+                           const MatchThreadConstants *constants) {
+  if (scratch.idRequest == constants->idRequest) {
+    return;
+  }
+  scratch.idRequest = constants->idRequest;
+
+  if (scratch.matchContext == nullptr) {
+    // The JIT stack is only used if the pattern could be JIT-compiled
+    scratch.matchContext = pcre2_match_context_create(nullptr);
+    scratch.jitStack =
+        pcre2_jit_stack_create(SIZ_JIT_STACK_MIN, SIZ_JIT_STACK_MAX, nullptr);
+    pcre2_jit_stack_assign(scratch.matchContext, nullptr, scratch.jitStack);
+  }
 
-          Match m = {};
-          m.offStart = ovector[0];
-          m.offEnd = ovector[1];
-
-          {
-            ZoneScopedN("LookupLineIndex");
-            // Lookup line index by binary search
-            size_t idxLeft = 0;
-            size_t idxRight = lineInfos.size() - 1;
-            size_t idxMiddle;
-            LineInfo *line;
-
-            while (idxLeft <= idxRight) {
-              idxMiddle = (idxLeft + idxRight) / 2;
-              line = &lineInfos[idxMiddle];
-              if (idxLeft == idxMiddle || idxRight == idxMiddle) {
-                break;
-              } else if (m.offStart < line->offStart) {
-                idxRight = idxMiddle;
-              } else if (line->offEnd < m.offStart) {
-                idxLeft = idxMiddle;
-              } else {
-                break;
-              }
-            }
+  if (constants->literal) {
+    return;
+  }
 
-            m.idxLine = idxMiddle;
-            m.idxColumn = m.offStart - line->offStart;
-            assert(idxMiddle != lineInfos.size());
-          }
+  uint32_t numCaptures = 0;
+  pcre2_pattern_info(constants->pattern, PCRE2_INFO_CAPTURECOUNT,
+                     &numCaptures);
+  if (scratch.matchData == nullptr ||
+      pcre2_get_ovector_count(scratch.matchData) < numCaptures + 1) {
+    pcre2_match_data_free(scratch.matchData);
+    scratch.matchData = pcre2_match_data_create(numCaptures + 1, nullptr);
+  }
+}
 
-          // TODO(danielm): groups
-          for (int i = 0; i < rc; i++) {
-            PCRE2_SPTR substring_start =
-                (PCRE2_SPTR8)pContents + ovector[2 * i];
-            PCRE2_SIZE substring_length = ovector[2 * i + 1] - ovector[2 * i];
+static void threadprocMatch(WorkerThreads *workers, uint32_t id) {
+  ZoneScoped;
+  auto threadName = fmt::format("Thread-Match#{}", id);
+  tracy::SetThreadName(threadName.c_str());
 
-            auto s =
-                std::string((const char *)substring_start, substring_length);
-          }
+  MatchScratch scratch;
 
-          assert(m.idxLine < lineInfos.size());
-          assert(m.offStart < sizContents);
-          assert(m.offEnd <= sizContents);
-          matches.push_back(m);
+  while (true) {
+    WaitUntilActive(workers->matchPool, id);
+    LoadedInput loaded;
+    workers->numMatchIdle++;
+    auto hasInput = Fetch(workers->loaded, loaded);
+    workers->numMatchIdle--;
+    if (!hasInput) {
+      break;
+    }
 
-          offset = ovector[1];
-        }
+    auto *constants = loaded.input.request;
+    if (constants->IsStopping()) {
+      // Only unload what the I/O stage still hands over
+      UnloadInput(loaded);
+      FinishInput(constants);
+      continue;
+    }
 
-        if (constants->aborted) {
-          shutdown = true;
-          break;
-        }
-      } while (rc > 0);
+    PrepareScratch(scratch, constants);
+    workers->bytesMatched += loaded.sizContents;
+    if (loaded.input.job) {
+      MatchWindow(constants, loaded, scratch);
+      FinishInput(constants);
+      continue;
     }
 
-    Mmap_Close(mmap);
+    auto &path = loaded.input.path;
+    auto sizContents = loaded.sizContents;
+    std::vector<Match> matches;
+    Arena snippets;
+    uint64_t numCounted = 0;
+    bool ok = true;
+    bool rewrite = constants->replacement && !constants->dryRun;
+    std::string replaced;
+
+    auto wholeFile = GetMatchOptions(constants, true, true);
+    auto format = Decomp_DetectFormat(loaded.pContents, loaded.sizContents);
+    // Compressed files are searched for replacements like any other, but
+    // they can't be written back
+    rewrite = rewrite && format == Decomp_Plain;
+    if (format != Decomp_Plain) {
+      ZoneScopedN("Match stream");
+      ZoneText(path.c_str(), path.size());
+      DecompressorHandle decomp;
+      if (Decomp_Open(decomp, format, loaded.pContents, loaded.sizContents) ==
+          Decomp_OK) {
+        ok = MatchStream(constants, decomp, scratch, sizContents, matches,
+                         snippets, numCounted);
+        Decomp_Close(decomp);
+      }
+      if (constants->outputMode != OUTPUT_MATCHES) {
+        // The stream may have been left early, and there are no offsets into
+        // it to show anyway
+        sizContents = loaded.sizContents;
+      }
+    } else if (constants->outputMode != OUTPUT_MATCHES) {
+      ZoneScopedN("Count loop");
+      ZoneText(path.c_str(), path.size());
+      size_t offLastMatchEnd;
+      ok = CountBuffer(constants, loaded.pContents, loaded.sizContents, 0,
+                       loaded.sizContents, wholeFile, scratch,
+                       GetCountLimit(constants), numCounted, offLastMatchEnd);
+    } else {
+      ZoneScopedN("Match loop");
+      ZoneText(path.c_str(), path.size());
+      ok = MatchBuffer(constants, loaded.pContents, loaded.sizContents, 0,
+                       loaded.sizContents, wholeFile, scratch,
+                       GetMatchLimit(constants), matches, snippets);
+    }
 
-    pcre2_match_data_free(matchData);
+    if (ok && constants->outputMode == OUTPUT_MATCHES) {
+      matches.resize(ReserveMatches(constants, matches.size()));
+    } else if (ok && constants->outputMode != OUTPUT_FILES_WITHOUT_MATCH) {
+      numCounted = ReserveMatches(constants, numCounted);
+    }
+    // Only the matches that are reported are replaced
+    if (rewrite && matches.size() > 0 && ok) {
+      ApplyReplacements(replaced, loaded.pContents, loaded.sizContents,
+                        matches);
+    }
+
+    UnloadInput(loaded);
+
+    auto replaceOutcome = UI_ROUntouched;
+    if (constants->replacement && format != Decomp_Plain) {
+      replaceOutcome = UI_ROCompressed;
+    } else if (rewrite && matches.size() > 0 && ok) {
+      ZoneScopedN("Write back");
+      ZoneText(path.c_str(), path.size());
+      Budget_Charge(replaced.capacity());
+      // The cached mapping would keep the old file alive, and on Windows it
+      // would keep the rename from replacing it
+      Mmap_Evict(path);
+      auto rc = WriteBack_Replace(path, loaded.identity, replaced.data(),
+                                  replaced.size());
+      Budget_Release(replaced.capacity());
+      if (rc == WriteBack_OK) {
+        replaceOutcome = UI_ROWritten;
+        constants->numFilesWritten++;
+      } else {
+        fmt::print("Failed to write back '{}' rc={}\n", path, (int)rc);
+        replaceOutcome = UI_ROFailed;
+        constants->numWriteFailures++;
+      }
+    }
 
-    if (matches.size() > 0) {
-      ZoneScopedN("Pushing results");
+    bool publish = matches.size() > 0 || numCounted > 0;
+    if (constants->outputMode == OUTPUT_FILES_WITHOUT_MATCH) {
+      publish = numCounted == 0;
+    }
+    if (publish && ok) {
       MatchThreadResult result;
-      result.path = std::move(input->path);
+      result.path = std::move(path);
       result.sizContents = sizContents;
+      result.mtime = loaded.identity.mtime;
       result.matches = std::move(matches);
-      result.lineInfo = std::move(lineInfos);
-      auto L = constants->results.lock();
-      constants->results.push(std::move(result));
-      constants->results.notify_one();
+      result.snippets = std::move(snippets);
+      result.replaceOutcome = replaceOutcome;
+      if (constants->outputMode == OUTPUT_COUNT) {
+        result.numMatchesCounted = numCounted;
+      }
+      PushResult(constants, std::move(result));
     }
+    FinishInput(constants);
   }
 
-  auto L = constants->results.lock();
-  constants->results.push();
-  constants->results.notify_one();
+  pcre2_match_data_free(scratch.matchData);
+  pcre2_match_context_free(scratch.matchContext);
+  pcre2_jit_stack_free(scratch.jitStack);
+}
+
+static void SetNumActive(WorkerPool &pool, uint32_t numActive) {
+  if (!pool.adaptive) {
+    return;
+  }
+  std::lock_guard G(pool.lock);
+  pool.numActive = std::clamp(numActive, 1u, pool.numThreads);
+  pool.cv.notify_all();
+}
+
+// Resizes the pools from the queue depths and the matching throughput.
+// Starved match threads with work still queued mean that I/O is the
+// bottleneck, and a full loaded queue means that matching is. An I/O thread
+// that was added without improving throughput is taken away again, since the
+// disk is saturated at that point.
+static void threadprocController(WorkerThreads *workers) {
+  tracy::SetThreadName("Thread-Controller");
+  auto &ioPool = workers->ioPool;
+  auto &matchPool = workers->matchPool;
+  uint64_t bytesMatchedPrev = workers->bytesMatched;
+  uint64_t throughputBeforeGrowingIo = 0;
+  bool grewIo = false;
+
+  std::unique_lock L(workers->lockController);
+  while (!workers->stopController) {
+    if (!workers->busy) {
+      grewIo = false;
+      workers->cvController.wait(
+          L, [&]() { return workers->busy || workers->stopController; });
+      bytesMatchedPrev = workers->bytesMatched;
+      continue;
+    }
+
+    workers->cvController.wait_for(
+        L, std::chrono::milliseconds(CONTROLLER_INTERVAL_MS));
+    if (workers->stopController) {
+      break;
+    }
+
+    ZoneScopedN("Resize pools");
+    size_t depthInputs, depthLoaded;
+    {
+      auto L = workers->inputs.lock();
+      depthInputs = workers->inputs.size();
+    }
+    {
+      auto L = workers->loaded.lock();
+      depthLoaded = workers->loaded.size();
+    }
+    auto bytesMatched = workers->bytesMatched.load();
+    auto throughput = bytesMatched - bytesMatchedPrev;
+    bytesMatchedPrev = bytesMatched;
+
+    uint32_t numIo = ioPool.numActive;
+    uint32_t numMatch = matchPool.numActive;
+    uint32_t numIdle = workers->numMatchIdle;
+
+    if (grewIo && throughput * 10 < throughputBeforeGrowingIo * 11) {
+      SetNumActive(ioPool, numIo - 1);
+      grewIo = false;
+    } else if (numIdle > 0 && depthLoaded == 0 && depthInputs > 0) {
+      if (numIo < ioPool.numThreads) {
+        throughputBeforeGrowingIo = throughput;
+        grewIo = true;
+        SetNumActive(ioPool, numIo + 1);
+      } else if (numIdle > 1) {
+        // Even every I/O thread can't keep the match threads busy
+        SetNumActive(matchPool, numMatch - 1);
+      }
+    } else if (depthLoaded >= NUM_LOADED_BACKLOG_PER_THREAD * numMatch) {
+      grewIo = false;
+      SetNumActive(matchPool, numMatch + 1);
+      SetNumActive(ioPool, numIo - 1);
+    } else {
+      grewIo = false;
+    }
+
+    TracyPlot("I/O threads", (int64_t)ioPool.numActive);
+    TracyPlot("Match threads", (int64_t)matchPool.numActive);
+    TracyPlot("Loaded queue", (int64_t)depthLoaded);
+  }
+}
+
+struct WorkerConfig {
+  uint32_t numIoThreads = 0;
+  uint32_t numMatchThreads = 0;
+  bool ioAdaptive = true;
+  bool matchAdaptive = true;
+  // CPUs the workers are pinned to; all of them if empty
+  std::vector<uint32_t> cpus;
+};
+
+static bool GetEnvCount(uint32_t &out, const char *name) {
+  auto *value = getenv(name);
+  if (value == nullptr) {
+    return false;
+  }
+
+  char *end;
+  auto count = strtoul(value, &end, 10);
+  if (end == value || *end != '\0' || count == 0) {
+    fmt::print("Ignoring {}='{}'\n", name, value);
+    return false;
+  }
+
+  out = (uint32_t)count;
+  return true;
+}
+
+// The pools are sized from the number of CPUs the workers may use. The
+// following environment variables override this:
+// - BORINGREP_CPUSET: pins the workers to a list of CPUs like "0-3,8"
+// - BORINGREP_IO_THREADS, BORINGREP_MATCH_THREADS: fixes the size of a pool
+static WorkerConfig GetWorkerConfig() {
+  WorkerConfig ret;
+
+  auto *cpuset = getenv("BORINGREP_CPUSET");
+  if (cpuset != nullptr && !Cpu_ParseSet(ret.cpus, cpuset)) {
+    fmt::print("Ignoring BORINGREP_CPUSET='{}'\n", cpuset);
+    ret.cpus.clear();
+  }
+
+  uint32_t numCpus = std::max(1u, std::thread::hardware_concurrency());
+  if (!ret.cpus.empty()) {
+    numCpus = ret.cpus.size();
+  }
+
+  ret.numMatchThreads = numCpus;
+  ret.numIoThreads = std::clamp(2 * numCpus, 4u, (uint32_t)MAX_IO_THREADS);
+  ret.matchAdaptive =
+      !GetEnvCount(ret.numMatchThreads, "BORINGREP_MATCH_THREADS");
+  ret.ioAdaptive = !GetEnvCount(ret.numIoThreads, "BORINGREP_IO_THREADS");
+  return ret;
+}
+
+void WorkerThreads::Start(const WorkerConfig &config) {
+  ioPool.numThreads = config.numIoThreads;
+  ioPool.adaptive = config.ioAdaptive;
+  // Loading is cheap on a warm cache; the controller adds I/O threads when
+  // the match threads starve
+  ioPool.numActive = config.ioAdaptive
+                         ? std::min(config.numIoThreads,
+                                    std::max(2u, config.numMatchThreads / 2))
+                         : config.numIoThreads;
+  ioPool.numRunning = config.numIoThreads;
+  matchPool.numThreads = config.numMatchThreads;
+  matchPool.adaptive = config.matchAdaptive;
+  matchPool.numActive = config.numMatchThreads;
+
+  for (uint32_t i = 0; i < config.numIoThreads; i++) {
+    ioThreads.push_back(std::thread(threadprocIo, this, i));
+  }
+  for (uint32_t i = 0; i < config.numMatchThreads; i++) {
+    matchThreads.push_back(std::thread(threadprocMatch, this, i));
+  }
+  if (!config.cpus.empty()) {
+    bool pinned = true;
+    for (auto &thread : ioThreads) {
+      pinned &= Cpu_PinThread(thread, config.cpus);
+    }
+    for (auto &thread : matchThreads) {
+      pinned &= Cpu_PinThread(thread, config.cpus);
+    }
+    if (!pinned) {
+      fmt::print("Failed to pin worker threads to BORINGREP_CPUSET\n");
+    }
+  }
+  if (config.ioAdaptive || config.matchAdaptive) {
+    controller = std::thread(threadprocController, this);
+  }
+}
+
+void WorkerThreads::Stop() {
+  if (controller.joinable()) {
+    {
+      std::lock_guard G(lockController);
+      stopController = true;
+    }
+    cvController.notify_one();
+    controller.join();
+  }
+
+  {
+    auto L = inputs.lock();
+    inputs.closed = true;
+    inputs.notify_all();
+  }
+
+  // Parked threads have to see the pipes closed too
+  for (auto *pool : {&ioPool, &matchPool}) {
+    std::lock_guard G(pool->lock);
+    pool->numActive = pool->numThreads;
+    pool->cv.notify_all();
+  }
+
+  for (auto &thread : ioThreads) {
+    thread.join();
+  }
+  for (auto &thread : matchThreads) {
+    thread.join();
+  }
+  ioThreads.clear();
+  matchThreads.clear();
 }
 
 struct PathMatcher {
@@ -274,7 +1593,8 @@ struct PathMatcher {
 
   bool Matches(const std::filesystem::path &path) {
     auto s = path.u8string();
-    int rc = pcre2_match_w(code, s.data(), s.size(), 0, 0, matchData);
+    int rc =
+        pcre2_match_w(code, s.data(), s.size(), 0, 0, matchData, nullptr);
     if (rc < 0) {
       switch (rc) {
         case PCRE2_ERROR_NOMATCH:
@@ -317,191 +1637,519 @@ struct PathMatcher {
   }
 };
 
-static UI_MatchRequestStatus DoGrep(MatchRequestStateAndContent &S,
-                                    const std::string &pathRoot,
-                                    const std::string &patternFilename) {
-  ZoneScoped;
+// Directory waiting to be listed
+struct PendingDirectory {
+  std::filesystem::path path;
+  // Relative to the root, with '/' separators; see PathRules
+  std::string relPath;
+  uint32_t depth;
+};
 
-  std::string errMsg;
-  auto pathMatcher = PathMatcher::Make(
-      patternFilename, [&](const std::string &err) { errMsg = err; });
+static std::string AppendRelPath(const std::string &relPathParent,
+                                 const std::filesystem::path &name) {
+  if (relPathParent.empty()) {
+    return name.u8string();
+  }
+  return relPathParent + '/' + name.u8string();
+}
 
-  if (!pathMatcher) {
-    fmt::print("Failed to make path matcher: {}\n", errMsg);
-    return UI_MRSBadFilenamePattern;
+// Decides which entries of the tree are visited. Directories reached more than
+// once, through bind mounts or symlinks, are only walked the first time, which
+// also breaks symlink cycles. Files with multiple hardlinks can be deduplicated
+// the same way. Subtrees that the path rules rule out aren't entered at all.
+struct TreeFilter {
+  struct Hash {
+    size_t operator()(const std::pair<uint64_t, uint64_t> &key) const {
+      return std::hash<uint64_t>()(key.second) ^
+             (std::hash<uint64_t>()(key.first) * 0x9E3779B97F4A7C15ull);
+    }
+  };
+  // Device/inode pairs
+  using VisitedSet = std::unordered_set<std::pair<uint64_t, uint64_t>, Hash>;
+
+  SymlinkPolicy followSymlinks = SYMLINKS_ROOT_ONLY;
+  bool dedupeFiles = false;
+  VisitedSet visitedDirectories;
+  VisitedSet visitedFiles;
+  PathRules rules;
+
+  explicit TreeFilter(const GrepRequest &request)
+      : followSymlinks(request.followSymlinks),
+        dedupeFiles(request.dedupeFiles) {}
+
+  bool FollowsSymlink(bool isRoot) const {
+    return followSymlinks == SYMLINKS_ALWAYS ||
+           (isRoot && followSymlinks == SYMLINKS_ROOT_ONLY);
   }
 
-  std::queue<std::filesystem::path> paths;
+  // Whether the directory should be walked. Takes one stat (one open on
+  // Windows) unless the rules already rule it out.
+  bool EnterDirectory(const PendingDirectory &dir, bool isSymlink) {
+    bool isRoot = dir.depth == 0;
+    if (isSymlink && !FollowsSymlink(isRoot)) {
+      return false;
+    }
+    if (!rules.AdmitsDirectory(dir.relPath)) {
+      return false;
+    }
+
+    FileIdentity identity;
+    if (!FileId_Get(identity, dir.path.u8string())) {
+      // Can't tell, but a directory that can't be stat'ed likely can't be
+      // listed either
+      return true;
+    }
+    return visitedDirectories.insert({identity.dev, identity.ino}).second;
+  }
 
-  paths.push(std::filesystem::path(pathRoot));
+  // Whether the file should be searched, as far as its path and links are
+  // concerned; its size and age are checked against the rules separately. Only
+  // takes a stat when deduplicating.
+  bool VisitFile(const std::filesystem::directory_entry &entry,
+                 const std::string &relPath) {
+    bool isSymlink = entry.is_symlink();
+    if (isSymlink && !FollowsSymlink(false)) {
+      return false;
+    }
+    if (!rules.AdmitsPath(relPath)) {
+      return false;
+    }
+    if (!dedupeFiles) {
+      return true;
+    }
+
+    FileIdentity identity;
+    if (!FileId_Get(identity, entry.path().u8string())) {
+      return true;
+    }
+    // A file reached through a symlink may be seen again under its own name
+    // even if it has a single link, so all of them are remembered in that case
+    if (identity.numLinks <= 1 && followSymlinks != SYMLINKS_ALWAYS) {
+      return true;
+    }
+    return visitedFiles.insert({identity.dev, identity.ino}).second;
+  }
+};
+
+// File that passed the filename pattern, the tree filter and the size and age
+// rules
+struct WalkedFile {
+  const std::filesystem::directory_entry &entry;
+  // Of the directory the file is in
+  uint32_t depth;
+  uint64_t size;
+  int64_t secsAge;
+  // Only meaningful for comparisons
+  int64_t mtime;
+};
+
+// Walks the tree below `pathRoot` breadth first. Calls `onFile` with every
+// WalkedFile and `onDirectoryListed` after each directory; the walk ends when
+// either of them returns false.
+template <typename OnFile, typename OnDirectoryListed>
+static void WalkTree(const std::string &pathRoot,
+                     PathMatcher &pathMatcher,
+                     TreeFilter &filter,
+                     OnFile &&onFile,
+                     OnDirectoryListed &&onDirectoryListed) {
+  std::queue<PendingDirectory> paths;
+  auto now = std::filesystem::file_time_type::clock::now();
+
+  PendingDirectory root{std::filesystem::path(pathRoot), "", 0};
+  if (filter.EnterDirectory(root, std::filesystem::is_symlink(root.path))) {
+    paths.push(std::move(root));
+  }
 
   while (!paths.empty()) {
     auto &P = paths.front();
-    for (auto &entry : std::filesystem::directory_iterator(P)) {
+    for (auto &entry : std::filesystem::directory_iterator(P.path)) {
+      auto relPath = AppendRelPath(P.relPath, entry.path().filename());
       if (entry.is_directory()) {
-        paths.push(entry.path());
+        PendingDirectory dir{entry.path(), relPath, P.depth + 1};
+        if (filter.EnterDirectory(dir, entry.is_symlink())) {
+          paths.push(std::move(dir));
+        }
       }
 
-      if (entry.is_regular_file()) {
-        UI_File file;
-        auto path = entry.path().u8string();
-        if (pathMatcher->Matches(entry.path().filename())) {
-          std::lock_guard G(S.state.lockFiles);
-          file.path = entry.path().u8string();
-          S.state.files.push_back(std::move(file));
-        }
+      if (!entry.is_regular_file() ||
+          !pathMatcher.Matches(entry.path().filename()) ||
+          !filter.VisitFile(entry, relPath)) {
+        continue;
+      }
+
+      WalkedFile file{entry, P.depth, 0, 0, 0};
+      std::error_code ec;
+      file.size = entry.file_size(ec);
+      if (ec) {
+        file.size = 0;
+      }
+      auto mtime = entry.last_write_time(ec);
+      if (!ec) {
+        file.secsAge =
+            std::chrono::duration_cast<std::chrono::seconds>(now - mtime)
+                .count();
+        file.mtime = mtime.time_since_epoch().count();
+      }
+      if (!filter.rules.AdmitsFile(file.size, file.secsAge)) {
+        continue;
+      }
+      if (!onFile(file)) {
+        return;
       }
     }
     paths.pop();
+
+    if (!onDirectoryListed()) {
+      return;
+    }
+  }
+}
+
+static UI_MatchRequestStatus DoGrep(MatchRequestStateAndContent &S,
+                                    const GrepRequest &request) {
+  ZoneScoped;
+
+  std::string errMsg;
+  auto pathMatcher = PathMatcher::Make(
+      request.patternFilename, [&](const std::string &err) { errMsg = err; });
+
+  if (!pathMatcher) {
+    fmt::print("Failed to make path matcher: {}\n", errMsg);
+    return UI_MRSBadFilenamePattern;
+  }
+
+  TreeFilter filter(request);
+  if (!filter.rules.Parse(request.pathRules, errMsg)) {
+    fmt::print("Failed to parse path rules: {}\n", errMsg);
+    return UI_MRSBadPathRules;
   }
 
-  S.state.status = UI_MRSFinished;
+  WalkTree(
+      request.pathRoot, *pathMatcher, filter,
+      [&](const WalkedFile &walked) {
+        UI_File file;
+        file.path = walked.entry.path().u8string();
+        file.size = walked.size;
+        file.mtime = walked.mtime;
+        S.state.Publish(std::move(file));
+        return true;
+      },
+      []() { return true; });
+
+  S.state.SetStatus(UI_MRSFinished);
 
   return UI_MRSFinished;
 }
 
-static UI_MatchRequestStatus DoGrep(MatchRequestStateAndContent &S,
-                                    const std::string &pathRoot,
-                                    const std::string &patternFilename,
-                                    const std::string &pattern) {
+// Inputs are searched in the order of this score, lowest first, so that the
+// results most likely to matter show up early: files close to the root, small
+// files (which are also quick to search) and recently modified ones.
+static uint32_t GetInputPriority(uint32_t depth,
+                                 uint64_t size,
+                                 int64_t secsAge) {
+  auto log2 = [](uint64_t x) {
+    uint32_t ret = 0;
+    while (x >>= 1) {
+      ret++;
+    }
+    return ret;
+  };
+  return depth * PRIORITY_DEPTH_WEIGHT + log2(size / 1024 + 1) +
+         log2(std::max<int64_t>(secsAge, 0) / 60 + 1);
+}
+
+// How long it took from the start of a request until the first file and the
+// first screenful of rows were published
+struct LatencyMetrics {
+  std::chrono::steady_clock::time_point start;
+  size_t numRowsPublished = 0;
+  std::optional<std::chrono::milliseconds> firstResult;
+  std::optional<std::chrono::milliseconds> firstScreenful;
+
+  void OnPublish(size_t numRows) {
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    if (!firstResult) {
+      firstResult = elapsed;
+      TracyPlot("Time to first result (ms)", (int64_t)elapsed.count());
+    }
+    numRowsPublished += numRows;
+    if (!firstScreenful && numRowsPublished >= NUM_ROWS_SCREENFUL) {
+      firstScreenful = elapsed;
+      TracyPlot("Time to first screenful (ms)", (int64_t)elapsed.count());
+    }
+  }
+};
+
+// Publishes the results that are ready without waiting for more. Returns false
+// if there were none.
+static bool PublishResults(MatchRequestStateAndContent &S,
+                           MatchThreadConstants &constants,
+                           LatencyMetrics &metrics) {
+  bool any = false;
+  while (true) {
+    auto L = constants.results.lock();
+    if (constants.results.empty()) {
+      return any;
+    }
+    auto result = std::move(constants.results.front());
+    constants.results.pop();
+    L.unlock();
+    any = true;
+
+    for (auto &match : result->matches) {
+      assert(match.offStart < result->sizContents);
+      assert(match.offEnd <= result->sizContents);
+      assert(match.snippet != nullptr);
+    }
+
+    metrics.OnPublish(1 + result->matches.size());
+    UI_File file;
+    file.path = std::move(result->path);
+    file.matches = std::move(result->matches);
+    file.snippets = std::move(result->snippets);
+    file.size = result->sizContents;
+    file.mtime = result->mtime;
+    file.replaceOutcome = result->replaceOutcome;
+    file.numMatchesCounted = result->numMatchesCounted;
+    S.state.Publish(std::move(file));
+    Budget_Release(result->sizBudget);
+  }
+}
+
+// Makes the workers drop the rest of the request, including those waiting
+// for the memory budget
+static void AbortRequest(MatchThreadConstants &constants) {
+  constants.aborted = true;
+  Budget_WakeWaiters();
+  fmt::print("[main thread] status became aborted\n");
+}
+
+static UI_MatchRequestStatus DoGrep(WorkerThreads &workers,
+                                    MatchRequestStateAndContent &S,
+                                    const GrepRequest &request) {
   ZoneScoped;
   MatchThreadConstants constants;
-  std::vector<std::thread> threads;
+  constants.idRequest = S.state.idRequest;
 
   auto start = std::chrono::high_resolution_clock::now();
 
   std::string errMsg;
   auto pathMatcher = PathMatcher::Make(
-      patternFilename, [&](const std::string &err) { errMsg = err; });
+      request.patternFilename, [&](const std::string &err) { errMsg = err; });
 
   if (!pathMatcher) {
     fmt::print("Failed to make path matcher: {}\n", errMsg);
     return UI_MRSBadFilenamePattern;
   }
 
-  int rc;
-  size_t offError;
-  constants.pattern = pcre2_compile((PCRE2_SPTR8)pattern.c_str(),
-                                    pattern.size(), 0, &rc, &offError, nullptr);
-  if (!constants.pattern) {
-    fmt::print("pcre2_compile failed rc={} offset={}\n", rc, offError);
-    return UI_MRSBadPattern;
+  TreeFilter filter(request);
+  if (!filter.rules.Parse(request.pathRules, errMsg)) {
+    fmt::print("Failed to parse path rules: {}\n", errMsg);
+    return UI_MRSBadPathRules;
   }
 
-  constants.aborted = false;
+  std::string literal;
+  bool inlineCaseless = false;
+  bool isLiteral;
+  if (request.fixedString) {
+    literal = request.pattern;
+    isLiteral = !literal.empty();
+  } else {
+    isLiteral = Scan_ParseLiteral(literal, inlineCaseless, request.pattern);
+  }
+  bool caseless = request.caseInsensitive || inlineCaseless;
+
+  if (isLiteral && (!caseless || Scan_IsAscii(literal))) {
+    constants.literal = Scan_MakeNeedle(literal, caseless);
+  } else {
+    uint32_t options = 0;
+    if (request.caseInsensitive) {
+      options |= PCRE2_CASELESS;
+    }
+    if (request.fixedString) {
+      options |= PCRE2_LITERAL;
+    }
+    if (request.multiline) {
+      options |= PCRE2_MULTILINE;
+    }
+    if (caseless && !Scan_IsAscii(request.pattern)) {
+      // ASCII folding is not enough here; let PCRE2 fold by Unicode case while
+      // still tolerating files that aren't valid UTF-8
+      options |= PCRE2_UTF | PCRE2_MATCH_INVALID_UTF;
+    }
 
-  for (uint32_t i = 0; i < std::thread::hardware_concurrency(); i++) {
-    threads.push_back(std::thread(threadprocMatch, &constants, i));
+    int rc;
+    size_t offError;
+    constants.pattern =
+        pcre2_compile((PCRE2_SPTR8)request.pattern.c_str(),
+                      request.pattern.size(), options, &rc, &offError, nullptr);
+    if (!constants.pattern) {
+      fmt::print("pcre2_compile failed rc={} offset={}\n", rc, offError);
+      return UI_MRSBadPattern;
+    }
+    // Falls back to the interpreter if JIT isn't available
+    pcre2_jit_compile(constants.pattern, PCRE2_JIT_COMPLETE);
   }
 
-  std::queue<std::filesystem::path> paths;
+  if (request.replace) {
+    constants.replacement.emplace();
+    if (!ParseReplacement(*constants.replacement, request.replacement,
+                          constants.pattern)) {
+      fmt::print("Bad replacement '{}'\n", request.replacement);
+      pcre2_code_free(constants.pattern);
+      return UI_MRSBadReplacement;
+    }
+    constants.dryRun = request.dryRun;
+  }
 
-  paths.push(std::filesystem::path(pathRoot));
+  constants.numContextBefore = request.numContextBefore;
+  constants.numContextAfter = request.numContextAfter;
+  constants.multiline = request.multiline;
+  if (!request.replace) {
+    constants.outputMode = request.outputMode;
+  }
+  if (request.maxCount != 0) {
+    constants.maxCount = request.maxCount;
+  }
+  if (request.maxCountPerFile != 0) {
+    constants.maxCountPerFile = request.maxCountPerFile;
+  }
+  constants.aborted = false;
+  S.state.SetAbortHandler([&constants]() {
+    auto L = constants.results.lock();
+    constants.results.notify_all();
+  });
 
   {
-    ZoneScopedN("Enumerate paths");
-    std::vector<MatchThreadInput> inputBacklog;
-    inputBacklog.reserve(threads.size());
-
-    while (!paths.empty()) {
-      auto &P = paths.front();
-      for (auto &entry : std::filesystem::directory_iterator(P)) {
-        if (entry.is_directory()) {
-          paths.push(entry.path());
-        }
-
-        if (entry.is_regular_file()) {
-          if (entry.file_size() > 1 * 1024 * 1024 * 1024) {
-            // Skip files bigger than 1GiB
-            continue;
-          }
-          if (pathMatcher->Matches(entry.path().filename())) {
-            inputBacklog.push_back({entry.path().u8string()});
-          }
-        }
+    std::lock_guard G(workers.lockController);
+    workers.busy = true;
+  }
+  workers.cvController.notify_one();
 
-        if (S.state.status == UI_MRSAborted) {
-          constants.aborted = true;
-          fmt::print("[main thread] status became aborted\n");
-          break;
-        }
+  LatencyMetrics metrics;
+  metrics.start = std::chrono::steady_clock::now();
 
-        if (inputBacklog.size() == threads.size()) {
-          auto L = constants.inputs.lock();
-          while (!inputBacklog.empty()) {
-            constants.inputs.push(std::move(inputBacklog.back()));
-            inputBacklog.pop_back();
-          }
-          constants.inputs.notify_all();
-        }
+  {
+    ZoneScopedN("Enumerate paths");
+    std::vector<MatchThreadInput> inputBacklog;
+    inputBacklog.reserve(SIZ_INPUT_BACKLOG);
+    uint64_t seq = 0;
+
+    auto flushBacklog = [&]() {
+      constants.numPending += inputBacklog.size();
+      auto L = workers.inputs.lock();
+      while (!inputBacklog.empty()) {
+        workers.inputs.push(std::move(inputBacklog.back()));
+        inputBacklog.pop_back();
       }
-      paths.pop();
-
+      workers.inputs.notify_all();
+    };
+    // Results of the first inputs can be shown long before the tree has been
+    // walked
+    auto publishAndCheck = [&]() {
+      PublishResults(S, constants, metrics);
       if (S.state.status == UI_MRSAborted) {
-        constants.aborted = true;
-        fmt::print("[main thread] status became aborted\n");
-        break;
+        AbortRequest(constants);
+        return false;
       }
-    }
-
-    if (S.state.status != UI_MRSAborted) {
-      auto L = constants.inputs.lock();
-      if (inputBacklog.size() > 0) {
-        while (!inputBacklog.empty()) {
-          constants.inputs.push(std::move(inputBacklog.back()));
-          inputBacklog.pop_back();
-        }
+      if (constants.limitReached) {
+        fmt::print("[main thread] match limit reached\n");
+        return false;
       }
+      return true;
+    };
+
+    WalkTree(
+        request.pathRoot, *pathMatcher, filter,
+        [&](const WalkedFile &walked) {
+          auto &entry = walked.entry;
+          auto size = walked.size;
+          auto priority =
+              GetInputPriority(walked.depth, size, walked.secsAge);
+
+          // Compressed streams can only be read from the start, whatever
+          // the file is called, and replacing needs the whole file in one
+          // piece. The list modes usually stop early in the first window,
+          // and counting straight through is cheap enough not to need
+          // windows either. Only files that would be split are peeked at.
+          auto path = entry.path().u8string();
+          if (size > SIZ_LARGE_FILE && !constants.replacement &&
+              constants.outputMode == OUTPUT_MATCHES &&
+              Decomp_DetectFileFormat(path) == Decomp_Plain) {
+            auto job = std::make_shared<LargeFileJob>();
+            job->path = std::move(path);
+            job->size = size;
+            auto numWindows = (size + SIZ_WINDOW - 1) / SIZ_WINDOW;
+            job->windows.resize(numWindows);
+            job->numRemaining = numWindows;
+            for (uint32_t i = 0; i < numWindows; i++) {
+              inputBacklog.push_back(
+                  {&constants, job->path, job, i, priority, seq++});
+            }
+          } else {
+            inputBacklog.push_back(
+                {&constants, std::move(path), nullptr, 0, priority, seq++});
+          }
+
+          if (inputBacklog.size() < SIZ_INPUT_BACKLOG) {
+            return S.state.status != UI_MRSAborted &&
+                   !constants.limitReached;
+          }
+          flushBacklog();
+          // A large directory would otherwise show nothing until it has been
+          // listed completely
+          return publishAndCheck();
+        },
+        publishAndCheck);
+
+    if (S.state.status == UI_MRSAborted && !constants.aborted) {
+      AbortRequest(constants);
     }
-    for (auto &thread : threads) {
-      constants.inputs.push();
+    if (!constants.IsStopping() && !inputBacklog.empty()) {
+      flushBacklog();
     }
-    constants.inputs.notify_all();
   }
 
-  size_t numThreadsRemain = threads.size();
-
   {
     ZoneScopedN("Receiving results");
-    while (numThreadsRemain != 0) {
+    while (true) {
       if (S.state.status == UI_MRSAborted) {
-        constants.aborted = true;
-        fmt::print("[main thread] status became aborted\n");
+        AbortRequest(constants);
         break;
       }
-      auto L = constants.results.lock();
-      if (constants.results.empty()) {
-        constants.results.wait_for(L, std::chrono::milliseconds(1));
-      }
-      if (!constants.results.empty()) {
-        auto result = std::move(constants.results.front());
-        constants.results.pop();
-        L.unlock();
-        if (!result.has_value()) {
-          numThreadsRemain -= 1;
-          continue;
-        }
-
-        for (auto &match : result->matches) {
-          assert(match.idxLine < result->lineInfo.size());
-          assert(match.offStart < result->sizContents);
-          assert(match.offEnd <= result->sizContents);
+      // Read before looking at the results, since workers push the results of
+      // an input before it stops being pending
+      bool done = constants.numPending == 0;
+      if (!PublishResults(S, constants, metrics)) {
+        if (done) {
+          break;
         }
-
-        UI_File file;
-        file.path = std::move(result->path);
-        file.lineInfo = std::move(result->lineInfo);
-        file.matches = std::move(result->matches);
-        std::lock_guard G(S.state.lockFiles);
-        S.state.files.push_back(file);
+        auto L = constants.results.lock();
+        constants.results.wait(L, [&]() {
+          return !constants.results.empty() || constants.numPending == 0 ||
+                 S.state.status == UI_MRSAborted;
+        });
       }
     }
   }
 
-  assert(constants.results.empty());
+  {
+    // After an abort the workers drop what's left of the request quickly
+    ZoneScopedN("Wait for workers");
+    auto L = constants.results.lock();
+    constants.results.wait(L, [&]() { return constants.numPending == 0; });
+  }
+  S.state.SetAbortHandler(nullptr);
+  {
+    std::lock_guard G(workers.lockController);
+    workers.busy = false;
+  }
 
-  for (auto &thread : threads) {
-    thread.join();
+  // Results left over after an abort still hold on to the budget
+  while (!constants.results.empty()) {
+    Budget_Release(constants.results.front()->sizBudget);
+    constants.results.pop();
   }
 
   pcre2_code_free(constants.pattern);
@@ -512,17 +2160,32 @@ static UI_MatchRequestStatus DoGrep(MatchRequestStateAndContent &S,
   fmt::print(
       "DoGrep took {} ms",
       std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+  if (metrics.firstResult) {
+    fmt::print(", first result after {} ms", metrics.firstResult->count());
+  }
+  if (metrics.firstScreenful) {
+    fmt::print(", first screenful after {} ms",
+               metrics.firstScreenful->count());
+  }
+  fmt::print("\n");
+  if (constants.replacement && !constants.dryRun) {
+    fmt::print("Rewrote {} files, {} failed\n",
+               constants.numFilesWritten.load(),
+               constants.numWriteFailures.load());
+  }
 
   return UI_MRSFinished;
 }
 
 struct UI_DataSourceImpl : UI_DataSource {
   std::list<MatchRequestStateAndContent> states;
+  WorkerThreads workers;
 
   bool shutdown = false;
   std::condition_variable cv;
   std::mutex lock;
   std::optional<GrepRequest> grepRequest;
+  uint64_t idNextRequest = 1;
 };
 
 UI_MatchRequestState *uiGetCurrentState(void *user) {
@@ -571,6 +2234,7 @@ int main(int argc, char **argv) {
   dataSource.getCurrentState = &uiGetCurrentState;
   dataSource.putRequest = &uiPutRequest;
 
+  dataSource.workers.Start(GetWorkerConfig());
   UI_Init(&dataSource, &dataSource);
 
   while (!dataSource.shutdown) {
@@ -579,27 +2243,31 @@ int main(int argc, char **argv) {
 
     if (dataSource.grepRequest) {
       for (auto &S : dataSource.states) {
-        S.state.status = UI_MRSAborted;
+        S.state.SetStatus(UI_MRSAborted);
       }
       dataSource.states.emplace_back();
       auto &S = dataSource.states.back();
-      S.state.status = UI_MRSPending;
+      S.state.idRequest = dataSource.idNextRequest++;
+      S.state.SetStatus(UI_MRSPending);
       auto request = std::move(dataSource.grepRequest.value());
+      S.state.lenPathRoot =
+          std::filesystem::path(request.pathRoot).u8string().size();
       L.unlock();
       dataSource.grepRequest.reset();
 
       if (request.pattern.empty()) {
-        S.state.status = DoGrep(S, request.pathRoot, request.patternFilename);
+        S.state.SetStatus(DoGrep(S, request));
       } else {
-        S.state.status = DoGrep(S, request.pathRoot, request.patternFilename,
-                                request.pattern);
+        S.state.SetStatus(DoGrep(dataSource.workers, S, request));
       }
     }
   }
 
   UI_Finish();
+  dataSource.workers.Stop();
 
   Mmap_CheckLeaks();
+  Mmap_Purge();
   return 0;
 }
 
@@ -0,0 +1,56 @@
+#include "fileid.hpp"
+
+#if WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+
+bool FileId_Get(FileIdentity &out, const std::string &path) {
+  // FILE_FLAG_BACKUP_SEMANTICS is needed to open directories
+  auto handle = CreateFileA(path.c_str(), 0,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS,
+                            nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  BY_HANDLE_FILE_INFORMATION info;
+  auto ok = GetFileInformationByHandle(handle, &info);
+  CloseHandle(handle);
+  if (!ok) {
+    return false;
+  }
+
+  out.dev = info.dwVolumeSerialNumber;
+  out.ino = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+  out.size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+  out.mtime = (int64_t(info.ftLastWriteTime.dwHighDateTime) << 32) |
+              info.ftLastWriteTime.dwLowDateTime;
+  out.numLinks = info.nNumberOfLinks;
+  return true;
+}
+#else
+#include <sys/stat.h>
+
+bool FileId_Get(FileIdentity &out, const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+
+  out.dev = st.st_dev;
+  out.ino = st.st_ino;
+  out.size = st.st_size;
+  // Whole seconds would miss a rewrite of the same size within a second
+#if defined(__APPLE__)
+  auto &mtim = st.st_mtimespec;
+#else
+  auto &mtim = st.st_mtim;
+#endif
+  out.mtime = int64_t(mtim.tv_sec) * 1000000000 + mtim.tv_nsec;
+  out.numLinks = st.st_nlink;
+  return true;
+}
+#endif
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+struct FileIdentity {
+  uint64_t dev = 0;
+  uint64_t ino = 0;
+  uint64_t size = 0;
+  // In nanoseconds on POSIX and 100ns units on Windows; only meaningful for
+  // comparisons
+  int64_t mtime = 0;
+  // Number of hardlinks to the file
+  uint32_t numLinks = 1;
+
+  bool SameFileAs(const FileIdentity &other) const {
+    return dev == other.dev && ino == other.ino;
+  }
+
+  bool SameContentsAs(const FileIdentity &other) const {
+    return SameFileAs(other) && size == other.size && mtime == other.mtime;
+  }
+};
+
+// Fills in the device/inode pair (volume serial/file index on Windows), the
+// size and the modification time of the file at `path`. Symlinks are followed.
+bool FileId_Get(FileIdentity &out, const std::string &path);
@@ -1,41 +1,167 @@
 #include "mmap.hpp"
 #include <mio/mmap.hpp>
 
+#include <atomic>
 #include <cassert>
-#include <unordered_set>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#if WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cerrno>
+#endif
+
+enum {
+  // Files up to this size are mapped whole and the mapping is kept in the
+  // cache; larger files are mapped in windows that are never cached
+  MMAP_MAX_CACHED_FILE = 256 * 1024 * 1024,
+  // Once the entries of a shard, open or idle, have more than its share of
+  // this many bytes mapped, idle entries are evicted until they don't
+  MMAP_CACHE_BUDGET = 512 * 1024 * 1024,
+  // Upper bound of the idle entries across all shards, so that trees of small
+  // files don't pile up entries
+  MMAP_MAX_IDLE_ENTRIES = 4096,
+  MMAP_NUM_SHARDS = 16,
+};
 
 struct MemoryMap_t {
   std::string path;
+  FileIdentity identity;
+
+  // Guarded by the shard lock
+  size_t refs = 0;
+  // Set when the file changed on disk; the entry is no longer in the shard's
+  // map and is freed as soon as the last handle is closed
+  bool stale = false;
+  bool inLru = false;
+  std::list<MemoryMap_t *>::iterator itLru;
+
+  // Guards the mappings below
+  std::mutex lock;
   mio::mmap_source src;
+  std::vector<mio::mmap_source> windows;
+};
+
+struct MmapShard {
+  std::mutex lock;
+  std::unordered_map<std::string, MemoryMap_t *> entries;
+  // Entries without open handles, least recently used at the back
+  std::list<MemoryMap_t *> lru;
+  std::atomic<size_t> mappedBytes{0};
 };
 
-#if !defined(NDEBUG)
-std::mutex gHandlesLock;
-std::unordered_set<MemoryMapHandle> gHandles;
+static MmapShard gShards[MMAP_NUM_SHARDS];
+
+static MmapShard &GetShard(const std::string &path) {
+  return gShards[std::hash<std::string>()(path) % MMAP_NUM_SHARDS];
+}
+
+// Maps through a handle that is closed right away. The mapping keeps the file
+// alive by itself, so cached entries don't hold on to file descriptors.
+static void MapFile(mio::mmap_source &out,
+                    const std::string &path,
+                    size_t offset,
+                    size_t len,
+                    std::error_code &rc) {
+#if WIN32
+  auto handle = CreateFileA(path.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE |
+                                FILE_SHARE_DELETE,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    rc = std::error_code(GetLastError(), std::system_category());
+    return;
+  }
+  out.map(handle, offset, len, rc);
+  CloseHandle(handle);
+#else
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    rc = std::error_code(errno, std::system_category());
+    return;
+  }
+  out.map(fd, offset, len, rc);
+  close(fd);
 #endif
+}
+
+static void FreeEntry(MmapShard &shard, MemoryMap_t *entry) {
+  assert(entry->refs == 0);
+  assert(entry->windows.empty());
+  if (entry->src.is_mapped()) {
+    shard.mappedBytes -= entry->src.size();
+  }
+  delete entry;
+}
+
+// Must be called with the shard lock held
+static void EvictIdleEntries(MmapShard &shard,
+                             size_t budget,
+                             size_t maxIdleEntries) {
+  while ((shard.mappedBytes > budget || shard.lru.size() > maxIdleEntries) &&
+         !shard.lru.empty()) {
+    auto *entry = shard.lru.back();
+    shard.lru.pop_back();
+    entry->inLru = false;
+    shard.entries.erase(entry->path);
+    FreeEntry(shard, entry);
+  }
+}
 
 MemoryMapStatus Mmap_Open(MemoryMapHandle &out, const std::string &path) {
   if (path.empty()) {
     return Mmap_Failure;
   }
 
-  mio::mmap_source src;
-
-  auto *ret = new MemoryMap_t;
-  if (!ret) {
+  FileIdentity identity;
+  if (!FileId_Get(identity, path)) {
     return Mmap_Failure;
   }
 
-  ret->path = path;
-  ret->src = std::move(src);
-  out = ret;
+  auto &shard = GetShard(path);
+  std::lock_guard G(shard.lock);
 
-#if !defined(NDEBUG)
-  {
-    std::lock_guard G(gHandlesLock);
-    gHandles.insert(ret);
+  auto it = shard.entries.find(path);
+  if (it != shard.entries.end()) {
+    auto *entry = it->second;
+    if (entry->identity.SameContentsAs(identity)) {
+      if (entry->inLru) {
+        shard.lru.erase(entry->itLru);
+        entry->inLru = false;
+      }
+      entry->refs++;
+      out = entry;
+      return Mmap_OK;
+    }
+
+    // The path now refers to a different file or the file was modified
+    shard.entries.erase(it);
+    if (entry->inLru) {
+      shard.lru.erase(entry->itLru);
+      entry->inLru = false;
+      FreeEntry(shard, entry);
+    } else {
+      entry->stale = true;
+    }
   }
-#endif
+
+  auto *ret = new MemoryMap_t;
+  ret->path = path;
+  ret->identity = identity;
+  ret->refs = 1;
+  shard.entries.emplace(path, ret);
+  out = ret;
 
   return Mmap_OK;
 }
@@ -49,69 +175,168 @@ MemoryMapStatus Mmap_Map(const void *&buf,
     return Mmap_InvalidHandle;
   }
 
-  if (file->src.is_mapped()) {
-    return Mmap_AlreadyMapped;
-  }
-
+  std::lock_guard G(file->lock);
   std::error_code rc;
-  if (offset == 0 && len == 0) {
-    file->src.map(file->path, rc);
-  } else {
-    file->src.map(file->path, offset, len, rc);
+
+  if (file->identity.size <= MMAP_MAX_CACHED_FILE) {
+    if (!file->src.is_mapped()) {
+      MapFile(file->src, file->path, 0, 0, rc);
+      if (rc) {
+        printf("mmap failure '%s' rc=%d\n", file->path.c_str(), rc.value());
+        return Mmap_Failure;
+      }
+      GetShard(file->path).mappedBytes += file->src.size();
+    }
+
+    auto size = file->src.size();
+    if (offset > size || (len != 0 && len > size - offset)) {
+      return Mmap_Failure;
+    }
+
+    buf = file->src.data() + offset;
+    out_len = (len == 0) ? size - offset : len;
+    return Mmap_OK;
   }
 
+  mio::mmap_source window;
+  MapFile(window, file->path, offset, len, rc);
+
   if (rc) {
     printf("mmap failure '%s' rc=%d\n", file->path.c_str(), rc.value());
     return Mmap_Failure;
   }
 
-  buf = file->src.data();
-  out_len = file->src.size();
+  buf = window.data();
+  out_len = window.size();
+  file->windows.push_back(std::move(window));
 
   return Mmap_OK;
 }
 
-MemoryMapStatus Mmap_Unmap(MemoryMapHandle file) {
+MemoryMapStatus Mmap_Unmap(MemoryMapHandle file, const void *buf) {
   if (!file) {
     return Mmap_InvalidHandle;
   }
 
-  if (!file->src.is_mapped()) {
-    return Mmap_NotMapped;
+  std::lock_guard G(file->lock);
+
+  if (file->src.is_mapped()) {
+    // Views into the whole-file mapping stay valid until the entry is evicted
+    auto *base = file->src.data();
+    if (base <= buf && buf <= base + file->src.size()) {
+      return Mmap_OK;
+    }
   }
 
-  file->src.unmap();
-  return Mmap_OK;
+  for (auto it = file->windows.begin(); it != file->windows.end(); ++it) {
+    if (it->data() == buf) {
+      file->windows.erase(it);
+      return Mmap_OK;
+    }
+  }
+
+  return Mmap_NotMapped;
 }
 
 MemoryMapStatus Mmap_Close(MemoryMapHandle &file) {
   if (!file) {
     return Mmap_InvalidHandle;
   }
-#if !defined(NDEBUG)
-  {
-    std::lock_guard G(gHandlesLock);
-    gHandles.erase(file);
+
+  auto &shard = GetShard(file->path);
+  std::lock_guard G(shard.lock);
+
+  assert(file->refs > 0);
+  file->refs--;
+  if (file->refs == 0) {
+    if (!file->windows.empty()) {
+      fmt::print("[mmap] {} window(s) of '{}' were never unmapped\n",
+                 file->windows.size(), file->path);
+      file->windows.clear();
+    }
+
+    if (file->stale || !file->src.is_mapped()) {
+      // Nothing worth caching: empty files and files that are only mapped in
+      // windows
+      if (!file->stale) {
+        shard.entries.erase(file->path);
+      }
+      FreeEntry(shard, file);
+    } else {
+      shard.lru.push_front(file);
+      file->itLru = shard.lru.begin();
+      file->inLru = true;
+      EvictIdleEntries(shard, MMAP_CACHE_BUDGET / MMAP_NUM_SHARDS,
+                       MMAP_MAX_IDLE_ENTRIES / MMAP_NUM_SHARDS);
+    }
   }
-#endif
 
-  delete file;
   file = nullptr;
   return Mmap_OK;
 }
 
+MemoryMapStatus Mmap_GetIdentity(FileIdentity &out, MemoryMapHandle file) {
+  if (!file) {
+    return Mmap_InvalidHandle;
+  }
+
+  // Immutable after Mmap_Open
+  out = file->identity;
+  return Mmap_OK;
+}
+
+MemoryMapStatus Mmap_Purge() {
+  for (auto &shard : gShards) {
+    std::lock_guard G(shard.lock);
+    while (!shard.lru.empty()) {
+      auto *entry = shard.lru.back();
+      shard.lru.pop_back();
+      shard.entries.erase(entry->path);
+      FreeEntry(shard, entry);
+    }
+  }
+
+  return Mmap_OK;
+}
+
+MemoryMapStatus Mmap_Evict(const std::string &path) {
+  auto &shard = GetShard(path);
+  std::lock_guard G(shard.lock);
+
+  auto it = shard.entries.find(path);
+  if (it == shard.entries.end()) {
+    return Mmap_OK;
+  }
+
+  auto *entry = it->second;
+  shard.entries.erase(it);
+  if (entry->inLru) {
+    shard.lru.erase(entry->itLru);
+    entry->inLru = false;
+    FreeEntry(shard, entry);
+  } else {
+    entry->stale = true;
+  }
+
+  return Mmap_OK;
+}
+
 MemoryMapStatus Mmap_CheckLeaks() {
 #if defined(NDEBUG)
   return Mmap_OK;
 #else
-  if (gHandles.size() > 0) {
-    for (auto &handle : gHandles) {
-      fmt::print("[mmap] leaked path='{}' is_mapped={}\n", handle->path,
-                 handle->src.is_mapped());
+  auto ret = Mmap_OK;
+  for (auto &shard : gShards) {
+    std::lock_guard G(shard.lock);
+    for (auto &[path, entry] : shard.entries) {
+      if (entry->refs > 0) {
+        fmt::print("[mmap] leaked path='{}' refs={} is_mapped={}\n", path,
+                   entry->refs, entry->src.is_mapped());
+        ret = Mmap_Failure;
+      }
     }
-    return Mmap_Failure;
   }
 
-  return Mmap_OK;
+  return ret;
 #endif
 }
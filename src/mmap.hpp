@@ -3,6 +3,8 @@
 #include <optional>
 #include <string>
 
+#include "fileid.hpp"
+
 typedef struct MemoryMap_t *MemoryMapHandle;
 
 enum MemoryMapStatus {
@@ -14,13 +16,29 @@ enum MemoryMapStatus {
 };
 	
 
+// Handles are shared and reference counted: opening a path that is already
+// open (or still cached) returns the same handle as long as the file's
+// identity (device, inode, size and mtime) hasn't changed.
 MemoryMapStatus Mmap_Open(MemoryMapHandle &out, const std::string &path);
+// Handles are safe to map from several threads at once. Small files are mapped
+// whole on first use and later calls return a view into that mapping without
+// a syscall.
 MemoryMapStatus Mmap_Map(const void *&buf,
                          size_t &out_len,
                          MemoryMapHandle file,
                          size_t offset = 0,
                          size_t len = 0);
-MemoryMapStatus Mmap_Unmap(MemoryMapHandle file);
+// `buf` is the pointer returned by Mmap_Map
+MemoryMapStatus Mmap_Unmap(MemoryMapHandle file, const void *buf);
+// Drops a reference. A whole-file mapping stays cached until evicted; entries
+// without one are freed along with their last handle.
 MemoryMapStatus Mmap_Close(MemoryMapHandle &file);
+// Identity of the file as of when the handle was first opened
+MemoryMapStatus Mmap_GetIdentity(FileIdentity &out, MemoryMapHandle file);
+// Unmaps every cached file that has no open handles
+MemoryMapStatus Mmap_Purge();
+// Forgets the cached mapping of `path`, e.g. before the file is replaced. If
+// the file is still open, the mapping is freed when the last handle is closed.
+MemoryMapStatus Mmap_Evict(const std::string &path);
 
 MemoryMapStatus Mmap_CheckLeaks();
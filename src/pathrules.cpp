@@ -0,0 +1,216 @@
+#include "pathrules.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+static std::vector<std::string> SplitPath(const std::string &path) {
+  std::vector<std::string> ret;
+  size_t offStart = 0;
+  while (offStart <= path.size()) {
+    auto offEnd = path.find('/', offStart);
+    if (offEnd == std::string::npos) {
+      offEnd = path.size();
+    }
+    if (offEnd > offStart) {
+      ret.push_back(path.substr(offStart, offEnd - offStart));
+    }
+    offStart = offEnd + 1;
+  }
+  return ret;
+}
+
+// Matches a single path component against a glob made of literal characters,
+// `*` and `?`
+static bool MatchComponent(const std::string &glob, const std::string &str) {
+  size_t idxGlob = 0;
+  size_t idxStr = 0;
+  // Position after the last `*` and the character it was tried to stop at
+  size_t idxGlobStar = std::string::npos;
+  size_t idxStrStar = 0;
+
+  while (idxStr < str.size()) {
+    if (idxGlob < glob.size() &&
+        (glob[idxGlob] == '?' || glob[idxGlob] == str[idxStr])) {
+      idxGlob++;
+      idxStr++;
+    } else if (idxGlob < glob.size() && glob[idxGlob] == '*') {
+      idxGlob++;
+      idxGlobStar = idxGlob;
+      idxStrStar = idxStr;
+    } else if (idxGlobStar != std::string::npos) {
+      // Let the last `*` swallow one more character
+      idxGlob = idxGlobStar;
+      idxStr = ++idxStrStar;
+    } else {
+      return false;
+    }
+  }
+
+  while (idxGlob < glob.size() && glob[idxGlob] == '*') {
+    idxGlob++;
+  }
+  return idxGlob == glob.size();
+}
+
+// Whether the glob matches the path or one of its ancestors. With
+// `orDescendant`, also whether it could match something under the path.
+static bool MatchComponents(const std::vector<std::string> &glob,
+                            size_t idxGlob,
+                            const std::vector<std::string> &path,
+                            size_t idxPath,
+                            bool orDescendant) {
+  if (idxGlob == glob.size()) {
+    return true;
+  }
+  if (glob[idxGlob] == "**") {
+    return MatchComponents(glob, idxGlob + 1, path, idxPath, orDescendant) ||
+           (idxPath < path.size() &&
+            MatchComponents(glob, idxGlob, path, idxPath + 1, orDescendant));
+  }
+  if (idxPath == path.size()) {
+    return orDescendant;
+  }
+  return MatchComponent(glob[idxGlob], path[idxPath]) &&
+         MatchComponents(glob, idxGlob + 1, path, idxPath + 1, orDescendant);
+}
+
+// Parses the number and unit of a size or age rule. `units` lists the suffixes
+// and `multipliers` their values.
+static bool ParseQuantity(uint64_t &out,
+                          const char *str,
+                          const char *units,
+                          const uint64_t *multipliers,
+                          uint64_t multiplierBare) {
+  if (!isdigit((unsigned char)*str)) {
+    return false;
+  }
+
+  uint64_t value = 0;
+  while (isdigit((unsigned char)*str)) {
+    auto digit = uint64_t(*str - '0');
+    if (value > (UINT64_MAX - digit) / 10) {
+      return false;
+    }
+    value = value * 10 + digit;
+    str++;
+  }
+
+  uint64_t multiplier = multiplierBare;
+  if (*str != '\0') {
+    auto *unit = strchr(units, tolower((unsigned char)*str));
+    if (unit == nullptr || str[1] != '\0') {
+      return false;
+    }
+    multiplier = multipliers[unit - units];
+  }
+
+  if (value > UINT64_MAX / multiplier) {
+    return false;
+  }
+  out = value * multiplier;
+  return true;
+}
+
+bool PathRules::Parse(const std::string &spec, std::string &err) {
+  static const uint64_t sizeMultipliers[] = {1024, 1024 * 1024,
+                                             1024 * 1024 * 1024};
+  static const uint64_t ageMultipliers[] = {1, 60, 60 * 60, 24 * 60 * 60,
+                                            7 * 24 * 60 * 60};
+
+  *this = PathRules();
+
+  size_t offStart = 0;
+  while (true) {
+    offStart = spec.find_first_not_of(" \t", offStart);
+    if (offStart == std::string::npos) {
+      return true;
+    }
+    auto offEnd = spec.find_first_of(" \t", offStart);
+    if (offEnd == std::string::npos) {
+      offEnd = spec.size();
+    }
+    auto rule = spec.substr(offStart, offEnd - offStart);
+    offStart = offEnd;
+
+    bool isSize = rule.compare(0, 4, "size") == 0;
+    bool isAge = rule.compare(0, 5, "mtime") == 0;
+    size_t offOp = isSize ? 4 : 5;
+    if ((isSize || isAge) && rule.size() > offOp &&
+        (rule[offOp] == '<' || rule[offOp] == '>')) {
+      bool below = rule[offOp] == '<';
+      uint64_t value;
+      bool ok = isSize ? ParseQuantity(value, rule.c_str() + offOp + 1, "kmg",
+                                       sizeMultipliers, 1)
+                       : ParseQuantity(value, rule.c_str() + offOp + 1,
+                                       "smhdw", ageMultipliers, 24 * 60 * 60);
+      if (!ok || (isAge && value > INT64_MAX)) {
+        err = "Malformed rule '" + rule + "'";
+        return false;
+      }
+
+      if (isSize && below) {
+        sizeBelow = std::min(sizeBelow, value);
+      } else if (isSize) {
+        sizeAbove = std::max(sizeAbove, value);
+        hasSizeAbove = true;
+      } else if (below) {
+        secsAgeBelow = std::min(secsAgeBelow, (int64_t)value);
+      } else {
+        secsAgeAbove = std::max(secsAgeAbove, (int64_t)value);
+      }
+      continue;
+    }
+
+    bool isExclude = rule[0] == '!';
+    auto glob = rule.substr(isExclude ? 1 : 0);
+    auto components = SplitPath(glob);
+    if (components.empty()) {
+      err = "Empty glob in rule '" + rule + "'";
+      return false;
+    }
+    // Unanchored
+    if (glob.find('/') == std::string::npos) {
+      components.insert(components.begin(), "**");
+    }
+    (isExclude ? excludes : includes).push_back(std::move(components));
+  }
+}
+
+static bool AdmitsGlobs(const std::vector<std::vector<std::string>> &includes,
+                       const std::vector<std::vector<std::string>> &excludes,
+                       const std::string &relPath,
+                       bool isDirectory) {
+  if (includes.empty() && excludes.empty()) {
+    return true;
+  }
+
+  auto path = SplitPath(relPath);
+  for (auto &glob : excludes) {
+    if (MatchComponents(glob, 0, path, 0, false)) {
+      return false;
+    }
+  }
+  if (includes.empty()) {
+    return true;
+  }
+  for (auto &glob : includes) {
+    if (MatchComponents(glob, 0, path, 0, isDirectory)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool PathRules::AdmitsDirectory(const std::string &relPath) const {
+  return AdmitsGlobs(includes, excludes, relPath, true);
+}
+
+bool PathRules::AdmitsPath(const std::string &relPath) const {
+  return AdmitsGlobs(includes, excludes, relPath, false);
+}
+
+bool PathRules::AdmitsFile(uint64_t size, int64_t secsAge) const {
+  return (!hasSizeAbove || size > sizeAbove) && size < sizeBelow &&
+         secsAge > secsAgeAbove && secsAge < secsAgeBelow;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Include/exclude rules on the path of a file relative to the search root, its
+// size and its age, separated by whitespace, e.g.
+//
+//   src/** !third_party size<5M mtime<7d
+//
+// A glob without a '/' matches a path component at any depth; one with a '/'
+// is anchored at the root. A glob that matches a directory also matches
+// everything under it. `*` and `?` stay within a component and `**` matches
+// any number of components. If there are include globs, a file must match one
+// of them; a file matching any '!' glob is skipped.
+//
+// `size<N` and `size>N` take an optional K, M or G suffix. `mtime<N` and
+// `mtime>N` compare the time since the last modification and take an optional
+// s, m, h, d or w suffix; days if there's none.
+struct PathRules {
+  // Returns false and describes the first malformed rule in `err`
+  bool Parse(const std::string &spec, std::string &err);
+
+  // Whether anything under the directory can pass the rules, so that the
+  // walker can skip whole subtrees. `relPath` uses '/' as separator and is
+  // empty for the root.
+  bool AdmitsDirectory(const std::string &relPath) const;
+  bool AdmitsPath(const std::string &relPath) const;
+  bool AdmitsFile(uint64_t size, int64_t secsAge) const;
+
+  // Globs split into components
+  std::vector<std::vector<std::string>> includes;
+  std::vector<std::vector<std::string>> excludes;
+
+  // Exclusive bounds
+  uint64_t sizeAbove = 0;
+  uint64_t sizeBelow = UINT64_MAX;
+  bool hasSizeAbove = false;
+  int64_t secsAgeAbove = INT64_MIN;
+  int64_t secsAgeBelow = INT64_MAX;
+};
@@ -7,15 +7,24 @@
 
 #include "Tracy.hpp"
 
-template <typename T>
+// `Queue` needs the interface of std::queue
+template <typename T, typename Queue = std::queue<std::optional<T>>>
 struct Pipe {
   TracyLockable(std::mutex, mtx);
   std::condition_variable_any cv;
-  std::queue<std::optional<T>> queue;
+  Queue queue;
+  // Set by the producer once nothing else will be pushed, for consumers that
+  // don't wait for a nullopt; guarded by the lock
+  bool closed = false;
 
   auto lock() { return std::unique_lock(mtx); }
   auto empty() const { return queue.empty(); }
+  auto size() const { return queue.size(); }
   auto wait(std::unique_lock<LockableBase(std::mutex)> &L) { cv.wait(L); }
+  template <typename Predicate>
+  auto wait(std::unique_lock<LockableBase(std::mutex)> &L, Predicate pred) {
+    cv.wait(L, pred);
+  }
   auto &front() { return queue.front(); }
   auto pop() { queue.pop(); }
   auto notify_one() { cv.notify_one(); }
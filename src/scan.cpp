@@ -0,0 +1,251 @@
+#include "scan.hpp"
+
+#include <cassert>
+#include <cctype>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SCAN_SSE2 1
+#include <emmintrin.h>
+#else
+#define SCAN_SSE2 0
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+static inline unsigned CountTrailingZeros(unsigned mask) {
+  assert(mask != 0);
+#if defined(_MSC_VER)
+  unsigned long idx;
+  _BitScanForward(&idx, mask);
+  return idx;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+static inline uint8_t FoldAscii(uint8_t c) {
+  return ('A' <= c && c <= 'Z') ? (c | 0x20) : c;
+}
+
+template <bool kCaseless>
+static inline uint8_t Fold(uint8_t c) {
+  return kCaseless ? FoldAscii(c) : c;
+}
+
+template <bool kCaseless>
+static bool Equals(const uint8_t *hay, const uint8_t *needle, size_t n) {
+  if (!kCaseless) {
+    return memcmp(hay, needle, n) == 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (FoldAscii(hay[i]) != needle[i]) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+#if SCAN_SSE2
+static inline __m128i FoldAscii16(__m128i v) {
+  // Move 'A'..'Z' to the bottom of the signed range so that a single signed
+  // compare picks them out
+  auto shifted = _mm_add_epi8(v, _mm_set1_epi8((char)(0x80 - 'A')));
+  auto isUpper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+  return _mm_or_si128(v, _mm_and_si128(isUpper, _mm_set1_epi8(0x20)));
+}
+
+template <bool kCaseless>
+static inline __m128i Load16(const uint8_t *p) {
+  auto v = _mm_loadu_si128((const __m128i *)p);
+  return kCaseless ? FoldAscii16(v) : v;
+}
+#endif
+
+// Compares the two rarest bytes of the needle against 16 candidate positions
+// at once and only verifies the full needle where both agree.
+template <bool kCaseless>
+static size_t Find(const ScanNeedle &needle,
+                   const uint8_t *hay,
+                   size_t size,
+                   size_t offset) {
+  auto *pNeedle = (const uint8_t *)needle.bytes.data();
+  const size_t n = needle.bytes.size();
+
+  if (n == 0 || size < n || offset > size - n) {
+    return SCAN_NPOS;
+  }
+
+  const size_t offLastStart = size - n;
+  size_t off = offset;
+
+#if SCAN_SSE2
+  const auto idxRare1 = needle.idxRare1;
+  const auto idxRare2 = needle.idxRare2;
+  const auto rare1 = _mm_set1_epi8((char)pNeedle[idxRare1]);
+  const auto rare2 = _mm_set1_epi8((char)pNeedle[idxRare2]);
+
+  while (off + 16 <= offLastStart + 1) {
+    auto h1 = Load16<kCaseless>(hay + off + idxRare1);
+    auto h2 = Load16<kCaseless>(hay + off + idxRare2);
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(h1, rare1), _mm_cmpeq_epi8(h2, rare2)));
+
+    while (mask != 0) {
+      auto offCandidate = off + CountTrailingZeros(mask);
+      if (Equals<kCaseless>(hay + offCandidate, pNeedle, n)) {
+        return offCandidate;
+      }
+      mask &= mask - 1;
+    }
+
+    off += 16;
+  }
+#endif
+
+  for (; off <= offLastStart; off++) {
+    if (Fold<kCaseless>(hay[off + needle.idxRare1]) ==
+            pNeedle[needle.idxRare1] &&
+        Equals<kCaseless>(hay + off, pNeedle, n)) {
+      return off;
+    }
+  }
+
+  return SCAN_NPOS;
+}
+
+// Rough frequency rank of a byte in source code and text; lower is rarer
+static int ByteRank(uint8_t c) {
+  static constexpr char LETTERS_BY_FREQUENCY[] = "zqjxkvbpygfwmucldrhsnioate";
+  static constexpr char COMMON_PUNCTUATION[] = "(){};,.=_-*/\"'<>:";
+
+  if (c == ' ' || c == '\n' || c == '\t' || c == '\r') {
+    return 255;
+  }
+
+  if ('a' <= c && c <= 'z') {
+    return 200 + (int)(strchr(LETTERS_BY_FREQUENCY, c) - LETTERS_BY_FREQUENCY);
+  }
+
+  if ('A' <= c && c <= 'Z') {
+    return 80 + (int)(strchr(LETTERS_BY_FREQUENCY, c | 0x20) -
+                      LETTERS_BY_FREQUENCY);
+  }
+
+  if (c != '\0' && strchr(COMMON_PUNCTUATION, c) != nullptr) {
+    return 150;
+  }
+
+  if ('0' <= c && c <= '9') {
+    return 120;
+  }
+
+  if (c >= 0x80) {
+    return 40;
+  }
+
+  if (c < 0x20 || c == 0x7F) {
+    return 10;
+  }
+
+  return 60;
+}
+
+bool Scan_ParseLiteral(std::string &out,
+                       bool &caseless,
+                       const std::string &pattern) {
+  static constexpr char META[] = "^$.|?*+()[]{}";
+  size_t off = 0;
+
+  caseless = false;
+  if (pattern.compare(0, 4, "(?i)") == 0) {
+    caseless = true;
+    off = 4;
+  }
+
+  out.clear();
+  for (; off < pattern.size(); off++) {
+    auto c = pattern[off];
+    if (c == '\\') {
+      // Escaped punctuation stands for itself; escapes like \d or \b don't
+      if (off + 1 == pattern.size()) {
+        return false;
+      }
+      auto e = (uint8_t)pattern[off + 1];
+      if (isalnum(e) || e >= 0x80) {
+        return false;
+      }
+      out.push_back((char)e);
+      off++;
+      continue;
+    }
+
+    if (c == '\0' || strchr(META, c) != nullptr) {
+      return false;
+    }
+
+    out.push_back(c);
+  }
+
+  return !out.empty();
+}
+
+bool Scan_IsAscii(const std::string &s) {
+  for (auto c : s) {
+    if ((uint8_t)c >= 0x80) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+ScanNeedle Scan_MakeNeedle(const std::string &needle, bool caseless) {
+  ScanNeedle ret;
+  ret.bytes = needle;
+  ret.caseless = caseless;
+
+  if (caseless) {
+    assert(Scan_IsAscii(needle));
+    for (auto &c : ret.bytes) {
+      c = (char)FoldAscii((uint8_t)c);
+    }
+  }
+
+  // A folded letter matches both of its cases, so rank it as lower case
+  int rankRare1 = 256, rankRare2 = 256;
+  for (size_t i = 0; i < ret.bytes.size(); i++) {
+    auto rank = ByteRank((uint8_t)ret.bytes[i]);
+    if (rank < rankRare1) {
+      ret.idxRare2 = ret.idxRare1;
+      rankRare2 = rankRare1;
+      ret.idxRare1 = i;
+      rankRare1 = rank;
+    } else if (rank < rankRare2 && ret.bytes[i] != ret.bytes[ret.idxRare1]) {
+      ret.idxRare2 = i;
+      rankRare2 = rank;
+    }
+  }
+
+  if (rankRare2 == 256) {
+    ret.idxRare2 = ret.idxRare1;
+  }
+
+  return ret;
+}
+
+size_t Scan_Find(const ScanNeedle &needle,
+                 const void *haystack,
+                 size_t size,
+                 size_t offset) {
+  if (needle.caseless) {
+    return Find<true>(needle, (const uint8_t *)haystack, size, offset);
+  } else {
+    return Find<false>(needle, (const uint8_t *)haystack, size, offset);
+  }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+static constexpr size_t SCAN_NPOS = SIZE_MAX;
+
+struct ScanNeedle {
+  // Needle bytes; folded to lower case when caseless
+  std::string bytes;
+  bool caseless = false;
+  // Positions of the two least common bytes of the needle; these are what the
+  // kernel compares against the haystack before verifying a candidate
+  size_t idxRare1 = 0;
+  size_t idxRare2 = 0;
+};
+
+// Returns true and stores the unescaped literal in `out` if `pattern` has no
+// regex metacharacters. A leading `(?i)` is stripped and reported through
+// `caseless`, even when the rest of the pattern turns out not to be a literal.
+bool Scan_ParseLiteral(std::string &out,
+                       bool &caseless,
+                       const std::string &pattern);
+bool Scan_IsAscii(const std::string &s);
+
+ScanNeedle Scan_MakeNeedle(const std::string &needle, bool caseless);
+
+// Returns the offset of the first occurrence of the needle at or after
+// `offset`, or SCAN_NPOS.
+size_t Scan_Find(const ScanNeedle &needle,
+                 const void *haystack,
+                 size_t size,
+                 size_t offset);
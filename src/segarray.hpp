@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <utility>
+
+// Append-only array with one producer and any number of readers.
+// Elements live in segments that never move once allocated, and the producer
+// publishes new elements by release-storing the count, so readers take a
+// consistent snapshot with an acquire load and never lock.
+template <typename T, size_t kFirstSegmentSize = 64>
+struct SegmentedArray {
+  // Segment k holds kFirstSegmentSize << k elements
+  static constexpr size_t MAX_SEGMENTS = 40;
+
+  SegmentedArray() = default;
+  SegmentedArray(const SegmentedArray &) = delete;
+  SegmentedArray &operator=(const SegmentedArray &) = delete;
+
+  ~SegmentedArray() {
+    auto n = count.load(std::memory_order_acquire);
+    for (size_t idx = 0; idx < n; idx++) {
+      (*this)[idx].~T();
+    }
+
+    for (auto &segment : segments) {
+      ::operator delete(segment.load(std::memory_order_relaxed));
+    }
+  }
+
+  // May only be called from the producer thread
+  void push_back(T &&value) {
+    auto idx = count.load(std::memory_order_relaxed);
+    size_t idxSegment, offset;
+    Locate(idxSegment, offset, idx);
+    assert(idxSegment < MAX_SEGMENTS);
+
+    auto *segment = segments[idxSegment].load(std::memory_order_relaxed);
+    if (segment == nullptr) {
+      segment = (T *)::operator new(sizeof(T) * (kFirstSegmentSize
+                                                 << idxSegment));
+      segments[idxSegment].store(segment, std::memory_order_relaxed);
+    }
+
+    new (&segment[offset]) T(std::move(value));
+    count.store(idx + 1, std::memory_order_release);
+  }
+
+  // Number of published elements; every index below this is safe to read
+  size_t size() const { return count.load(std::memory_order_acquire); }
+  bool empty() const { return size() == 0; }
+
+  T &operator[](size_t idx) {
+    size_t idxSegment, offset;
+    Locate(idxSegment, offset, idx);
+    return segments[idxSegment].load(std::memory_order_relaxed)[offset];
+  }
+
+  const T &operator[](size_t idx) const {
+    return const_cast<SegmentedArray *>(this)->operator[](idx);
+  }
+
+ private:
+  static void Locate(size_t &idxSegment, size_t &offset, size_t idx) {
+    // Segment k starts at element kFirstSegmentSize * (2^k - 1)
+    size_t q = idx / kFirstSegmentSize + 1;
+    idxSegment = 0;
+    while (q > 1) {
+      q >>= 1;
+      idxSegment++;
+    }
+    offset = idx - kFirstSegmentSize * ((size_t(1) << idxSegment) - 1);
+  }
+
+  std::atomic<T *> segments[MAX_SEGMENTS] = {};
+  std::atomic<size_t> count{0};
+};
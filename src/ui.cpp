@@ -1,9 +1,11 @@
 #include "ui.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
-#include <map>
-#include <unordered_set>
+#include <cmath>
+#include <cstring>
+#include <unordered_map>
 
 #include <raylib.h>
 #define RAYGUI_IMPLEMENTATION
@@ -11,8 +13,10 @@
 
 #include "BTracy.hpp"
 
+#include "arena.hpp"
+#include "dirlist.hpp"
 #include "utf8.hpp"
-#include "win32.hpp"
+#include "view.hpp"
 
 enum Action {
   ACTION_NONE,
@@ -35,6 +39,25 @@ static constexpr float TEXT_HEIGHT = INPUT_HEIGHT - 2.0f;
 static constexpr Vector2 TEXT_OFFSET = {2.0f, 2.0f};
 static constexpr float VERT_GAP = 4.0f;
 static constexpr float PADDING_HORI = 4.0f;
+static constexpr float CHECKBOX_STRIDE = 96.0f;
+static constexpr float ROW_HEIGHT = 16.0f;
+static constexpr float SCROLLBAR_WIDTH = 12.0f;
+// How often input and new results are checked for while nothing is redrawn
+static constexpr float IDLE_POLL_MS = 16.0f;
+static constexpr float IDLE_POLL_MS_UNFOCUSED = 100.0f;
+// Scrolling slower than this (in pixels per second) stops the animation
+static constexpr float MIN_SCROLL_VELOCITY = 1.0f;
+// Upper bound of the time step of the scroll animation; the first frame after
+// an idle period would otherwise see the whole idle time as its frame time
+static constexpr float MAX_FRAME_TIME = 1.0f / 30.0f;
+static constexpr float RESULT_TEXT_HEIGHT = 10.0f;
+static constexpr float RESULT_TEXT_SPACING = 1.0f;
+// Background of the capture group shown in the results and the preview
+static constexpr Color HIGHLIGHT_COLOR = {255, 222, 120, 255};
+// Capture groups that can be picked for highlighting; 0 is the whole match
+static constexpr int MAX_SHOWN_GROUP = 9;
+// Largest match limit that can be entered; 0 means no limit
+static constexpr int MAX_MATCH_LIMIT = 1000000;
 
 static bool gUiInited = false;
 
@@ -46,146 +69,376 @@ enum {
   LEN_BUF_PATTERN = 1024,
 };
 
-struct PreviewState {
-  std::optional<std::string> contents;
-  size_t idxMatch;
-  std::string path;
-
-  Vector2 position;
+struct GlyphPlacement {
+  int codepoint;
+  Vector2 offset;
 };
 
-using UI_RenderFunction = std::function<void()>;
-struct UI_RenderLayers {
-  std::map<int, std::vector<UI_RenderFunction>> layers;
+// Text measured and broken into positioned glyphs once, so drawing it again
+// needs neither UTF-8 decoding nor measuring
+struct TextLayout {
+  Vector2 extents = {0, 0};
+  std::vector<GlyphPlacement> glyphs;
+  // Drawn behind the glyphs, one per line of the highlighted bytes
+  std::vector<Rectangle> highlights;
+
+  // Mirrors what DrawTextEx does to place the glyphs. The bytes
+  // [offHighlightStart, offHighlightEnd) are highlighted.
+  void Shape(const Font &font,
+             float fontSize,
+             float spacing,
+             const char *text,
+             size_t offHighlightStart = 0,
+             size_t offHighlightEnd = 0) {
+    ZoneScoped;
+    glyphs.clear();
+    highlights.clear();
+    float scaleFactor = fontSize / font.baseSize;
+    float x = 0, y = 0;
+    float width = 0;
+    bool inHighlight = false;
+
+    auto endHighlight = [&]() {
+      highlights.back().width = x - highlights.back().x;
+      inHighlight = false;
+    };
+
+    for (int i = 0; text[i] != '\0';) {
+      // Restarted on every line the highlighted bytes continue on
+      bool isHighlighted =
+          (size_t)i >= offHighlightStart && (size_t)i < offHighlightEnd;
+      if (isHighlighted && !inHighlight) {
+        highlights.push_back({x, y, 0, fontSize});
+        inHighlight = true;
+      } else if (!isHighlighted && inHighlight) {
+        endHighlight();
+      }
 
-  void Push(int layer, UI_RenderFunction &&func) {
-    if (layers.count(layer) == 0) {
-      layers[layer] = {};
-    }
+      int bytes = 0;
+      int codepoint = GetCodepoint(&text[i], &bytes);
+      // GetCodepoint returns '?' for invalid sequences
+      if (codepoint == 0x3f) {
+        bytes = 1;
+      }
+      i += bytes;
 
-    layers[layer].emplace_back(std::move(func));
-  }
+      if (codepoint == '\n') {
+        if (inHighlight) {
+          endHighlight();
+        }
+        y += (font.baseSize + font.baseSize / 2) * scaleFactor;
+        x = 0;
+        continue;
+      }
 
-  void Execute() {
-    for (auto &[layer, functions] : layers) {
-      for (auto &func : functions) {
-        func();
+      if (codepoint != ' ' && codepoint != '\t') {
+        glyphs.push_back({codepoint, {x, y}});
       }
+
+      auto index = GetGlyphIndex(font, codepoint);
+      float advance = font.glyphs[index].advanceX;
+      if (advance == 0) {
+        advance = font.recs[index].width;
+      }
+      x += advance * scaleFactor + spacing;
+      width = std::max(width, x - spacing);
     }
 
-    for (auto &[layer, functions] : layers) {
-      functions.clear();
+    if (inHighlight) {
+      endHighlight();
     }
+    extents = {width, y + fontSize};
   }
-};
 
-struct DirectoryFilter {
-  DirectoryFilter(std::filesystem::path root) {
-    if (root.empty()) {
-      auto drives = W32_GetLogicalDriveStrings();
-      if (drives.empty()) {
-        root = std::filesystem::path("/");
-      } else {
-        for (auto &drive : drives) {
-          subDirectories.push_back(std::filesystem::directory_entry(drive));
-        }
-        return;
+  void Draw(const Font &font, float fontSize, Vector2 pos, Color color) const {
+    for (auto &highlight : highlights) {
+      if (highlight.width > 0) {
+        DrawRectangleRec({pos.x + highlight.x, pos.y + highlight.y,
+                          highlight.width, highlight.height},
+                         HIGHLIGHT_COLOR);
       }
     }
-
-    for (auto &entry : std::filesystem::directory_iterator(root)) {
-      if (entry.is_directory()) {
-        subDirectories.push_back(entry);
-      }
+    for (auto &glyph : glyphs) {
+      DrawTextCodepoint(font, glyph.codepoint,
+                        {pos.x + glyph.offset.x, pos.y + glyph.offset.y},
+                        fontSize, color);
     }
   }
+};
 
-  void Update(const std::string &filter) {
-    filteredEntries.clear();
-    notFilteredEntries.clear();
-    exactMatches.clear();
-    for (size_t idxEntry = 0; idxEntry < subDirectories.size(); idxEntry++) {
-      auto &entry = subDirectories[idxEntry];
-      auto name = entry.path().filename().u8string();
-      if (name.empty()) {
-        // Filename is be empty when the entry refers to a Windows drive
-        name = entry.path().u8string();
-      }
-      bool filtered = false;
-      for (size_t i = 0; i < filter.size() && i < name.size(); i++) {
-        if (name[i] != filter[i]) {
-          filteredEntries.insert(idxEntry);
-          filtered = true;
-          break;
-        }
-      }
-      if (!filtered) {
-        if (name.size() == filter.size()) {
-          exactMatches.insert(idxEntry);
+struct HighlightedText {
+  HighlightedText(std::string text) : text(std::move(text)) {}
+
+  std::string text;
+  size_t offHighlightStart = 0;
+  size_t offHighlightEnd = 0;
+};
+
+// Layouts of the result rows, keyed by file and by what the row shows: 0 is
+// the file's header, 1 + i its i-th match and UINT32_MAX the header of the
+// file's directory. Keys don't depend on the sort order or the refine filter.
+// All of them are dropped when the font, the text size, the window size, the
+// request or the highlighted group changes.
+struct TextLayoutCache {
+  struct Entry {
+    TextLayout layout;
+    uint64_t idxLastUsedFrame;
+  };
+
+  static constexpr size_t MAX_ENTRIES = 1024;
+
+  std::unordered_map<uint64_t, Entry> entries;
+  uint64_t idxFrame = 0;
+  uint64_t idRequest = 0;
+  // Capture group that the layouts highlight
+  uint32_t idxGroup = 0;
+
+  unsigned idFontTexture = 0;
+  float fontSize = 0;
+  int screenWidth = 0;
+  int screenHeight = 0;
+
+  static uint64_t MakeKey(size_t idxFile, size_t idxItem) {
+    return (uint64_t(idxFile) << 32) | uint64_t(idxItem);
+  }
+
+  void BeginFrame(const Font &font, float fontSize) {
+    ZoneScoped;
+    idxFrame++;
+
+    if (font.texture.id != idFontTexture || fontSize != this->fontSize ||
+        GetScreenWidth() != screenWidth || GetScreenHeight() != screenHeight) {
+      entries.clear();
+      idFontTexture = font.texture.id;
+      this->fontSize = fontSize;
+      screenWidth = GetScreenWidth();
+      screenHeight = GetScreenHeight();
+    }
+
+    if (entries.size() > MAX_ENTRIES) {
+      // Keep only what was on screen in the previous frame
+      for (auto it = entries.begin(); it != entries.end();) {
+        if (it->second.idxLastUsedFrame + 1 < idxFrame) {
+          it = entries.erase(it);
+        } else {
+          ++it;
         }
-        notFilteredEntries.insert(idxEntry);
       }
     }
   }
 
-  bool GetNextEntry(size_t &out, size_t i) const {
-    if (filteredEntries.count(i) != 0) {
-      return false;
+  void Clear() { entries.clear(); }
+
+  // `makeText` is only called when the layout is not cached yet. It returns
+  // the text, optionally with a highlighted range.
+  template <typename MakeText>
+  const TextLayout &Get(uint64_t key,
+                        const Font &font,
+                        float spacing,
+                        MakeText &&makeText) {
+    auto [it, inserted] = entries.try_emplace(key);
+    auto &entry = it->second;
+    if (inserted) {
+      HighlightedText text = makeText();
+      entry.layout.Shape(font, fontSize, spacing, text.text.c_str(),
+                         text.offHighlightStart, text.offHighlightEnd);
     }
+    entry.idxLastUsedFrame = idxFrame;
+    return entry.layout;
+  }
+};
 
-    out++;
-    while (out < subDirectories.size()) {
-      if (filteredEntries.count(out) == 0) {
-        return true;
+struct PreviewState {
+  std::optional<std::string> contents;
+  size_t idxMatch;
+  uint32_t idxGroup = 0;
+  std::string path;
+  TextLayout layout;
+
+  Vector2 position;
+};
+
+// Draw commands recorded during a frame and replayed in layer order at its
+// end. Commands are plain data and their strings are copied into a frame
+// arena, so once the buffers have reached their steady-state size recording
+// and replaying a frame doesn't allocate.
+struct UI_RenderLayers {
+  enum CommandType {
+    CMD_RECTANGLE,
+    CMD_RECTANGLE_LINES,
+    CMD_LINE,
+    CMD_TEXT,
+  };
+
+  struct Command {
+    int layer;
+    // Recording order; keeps the sort stable within a layer
+    uint32_t seq;
+    CommandType type;
+    Color color;
+    // CMD_LINE uses (x, y) as the start and (width, height) as the end point
+    Rectangle rect;
+    Font font;
+    float fontSize;
+    float spacing;
+    const char *text;
+  };
+
+  std::vector<Command> commands;
+  Arena arena{16 * 1024, 64 * 1024};
+
+  Command &Push(int layer, CommandType type, Color color) {
+    auto &cmd = commands.emplace_back();
+    cmd.layer = layer;
+    cmd.seq = (uint32_t)commands.size();
+    cmd.type = type;
+    cmd.color = color;
+    return cmd;
+  }
+
+  void PushRectangle(int layer, const Rectangle &rect, Color color) {
+    Push(layer, CMD_RECTANGLE, color).rect = rect;
+  }
+
+  void PushRectangleLines(int layer, const Rectangle &rect, Color color) {
+    Push(layer, CMD_RECTANGLE_LINES, color).rect = rect;
+  }
+
+  void PushLine(int layer, Vector2 from, Vector2 to, Color color) {
+    Push(layer, CMD_LINE, color).rect = {from.x, from.y, to.x, to.y};
+  }
+
+  void PushText(int layer,
+                Font font,
+                const char *text,
+                Vector2 pos,
+                float fontSize,
+                float spacing,
+                Color color) {
+    auto &cmd = Push(layer, CMD_TEXT, color);
+    cmd.rect = {pos.x, pos.y, 0, 0};
+    cmd.font = font;
+    cmd.fontSize = fontSize;
+    cmd.spacing = spacing;
+    cmd.text = arena.CopyString(text, strlen(text));
+  }
+
+  void Execute() {
+    ZoneScoped;
+    std::sort(commands.begin(), commands.end(),
+              [](const Command &lhs, const Command &rhs) {
+                if (lhs.layer != rhs.layer) {
+                  return lhs.layer < rhs.layer;
+                }
+                return lhs.seq < rhs.seq;
+              });
+
+    for (auto &cmd : commands) {
+      auto &rect = cmd.rect;
+      switch (cmd.type) {
+        case CMD_RECTANGLE:
+          DrawRectangle(rect.x, rect.y, rect.width, rect.height, cmd.color);
+          break;
+        case CMD_RECTANGLE_LINES:
+          DrawRectangleLines(rect.x, rect.y, rect.width, rect.height,
+                             cmd.color);
+          break;
+        case CMD_LINE:
+          DrawLine(rect.x, rect.y, rect.width, rect.height, cmd.color);
+          break;
+        case CMD_TEXT:
+          DrawTextEx(cmd.font, cmd.text, {rect.x, rect.y}, cmd.fontSize,
+                     cmd.spacing, cmd.color);
+          break;
       }
     }
 
-    return false;
+    commands.clear();
+    arena.Reset();
   }
+};
 
-  bool GetPrevEntry(size_t &out, size_t i) const {
-    if (filteredEntries.count(i) == 0) {
-      return false;
+// Subdirectories of a directory, kept sorted by name so that the entries
+// starting with the filter are a contiguous range found by binary search.
+// Entries stream in from a DirectoryLister while the finder is open.
+struct DirectoryFilter {
+  DirectoryFilter(const std::filesystem::path &root)
+      : root(root), lister(root) {}
+
+  // Merges the entries listed since the last call into the index
+  void Poll() {
+    if (isComplete) {
+      return;
     }
 
-    out--;
-    while (0 < out) {
-      if (filteredEntries.count(out) == 0) {
-        return true;
-      }
+    ZoneScoped;
+    // Checked before polling, so nothing listed before it was set is missed
+    isComplete = lister.IsFinished();
+    lister.Poll(newNames);
+    if (newNames.empty()) {
+      return;
     }
 
-    assert(out == 0);
+    std::sort(newNames.begin(), newNames.end());
+    auto numOldNames = names.size();
+    names.insert(names.end(), std::make_move_iterator(newNames.begin()),
+                 std::make_move_iterator(newNames.end()));
+    newNames.clear();
+    std::inplace_merge(names.begin(), names.begin() + numOldNames, names.end());
+    Refilter();
+  }
 
-    return filteredEntries.count(0) == 0;
+  void Update(const std::string &filter) {
+    this->filter = filter;
+    Refilter();
   }
 
-  size_t NumRemains() const {
-    return subDirectories.size() - filteredEntries.size();
+  void Refilter() {
+    auto itBegin = std::lower_bound(names.begin(), names.end(), filter);
+    auto itEnd =
+        std::partition_point(itBegin, names.end(), [&](const std::string &name) {
+          return name.compare(0, filter.size(), filter) == 0;
+        });
+    idxBegin = std::distance(names.begin(), itBegin);
+    idxEnd = std::distance(names.begin(), itEnd);
   }
-  std::filesystem::directory_entry GetRemainingEntry() const {
-    assert(NumRemains() == 1);
-    //
-    for (auto idxEntry : notFilteredEntries) {
-      return subDirectories[idxEntry];
-    }
 
-    std::abort();
+  size_t NumRemains() const { return idxEnd - idxBegin; }
+
+  std::filesystem::path GetPath(size_t idxName) const {
+    // For drives `root` is empty and the name is the whole path
+    return root / names[idxName];
   }
 
-  bool TryGetExactMatch(std::filesystem::directory_entry &out) {
-    for (auto idxEntry : exactMatches) {
-      out = subDirectories[idxEntry];
-      return true;
+  // Only succeeds once the listing is complete; until then more entries with
+  // the same prefix may still turn up
+  bool TryGetRemainingEntry(std::filesystem::path &out) const {
+    if (!isComplete || NumRemains() != 1) {
+      return false;
     }
+    out = GetPath(idxBegin);
+    return true;
+  }
 
-    return false;
+  bool TryGetExactMatch(std::filesystem::path &out) const {
+    // The exact match, if any, sorts first among the names with the prefix
+    if (idxBegin == idxEnd || names[idxBegin] != filter) {
+      return false;
+    }
+    out = GetPath(idxBegin);
+    return true;
   }
 
-  std::vector<std::filesystem::directory_entry> subDirectories;
-  std::unordered_set<size_t> filteredEntries;
-  std::unordered_set<size_t> notFilteredEntries;
-  std::unordered_set<size_t> exactMatches;
+  std::filesystem::path root;
+  DirectoryLister lister;
+  bool isComplete = false;
+
+  std::vector<std::string> names;
+  std::vector<std::string> newNames;
+  std::string filter;
+  // Range of `names` that start with `filter`
+  size_t idxBegin = 0;
+  size_t idxEnd = 0;
 };
 
 struct BaseInputBox {
@@ -218,12 +471,20 @@ struct BaseInputBox {
 
   virtual Color GetBorderColor() { return DARKBLUE; }
 
+  // Whether the box shows something that changes without input
+  virtual bool IsAnimating() const { return false; }
+
   void DrawBox(const Rectangle &rect) {
     DrawRectangle(rect.x, rect.y, rect.width, rect.height,
                   GetBackgroundColor());
     DrawRectangleLines(rect.x, rect.y, rect.width, rect.height,
                        GetBorderColor());
   }
+
+  void PushBox(UI_RenderLayers &layers, int layer, const Rectangle &rect) {
+    layers.PushRectangle(layer, rect, GetBackgroundColor());
+    layers.PushRectangleLines(layer, rect, GetBorderColor());
+  }
 };
 
 struct InputBox : BaseInputBox {
@@ -366,22 +627,12 @@ struct PathInputBox : BaseInputBox {
     }
 
     if (finder) {
-      std::filesystem::directory_entry entry;
-      bool hasEntry = false;
-
-      if (finder->filter.NumRemains() == 1) {
-        entry = finder->filter.GetRemainingEntry();
-        hasEntry = true;
-      } else if (finder->filter.TryGetExactMatch(entry)) {
-        hasEntry = true;
-      }
+      finder->filter.Poll();
+      std::filesystem::path newPath;
+      bool hasEntry = finder->filter.TryGetRemainingEntry(newPath) ||
+                      finder->filter.TryGetExactMatch(newPath);
 
       if (hasEntry) {
-        auto newPath = entry.path();
-        std::error_code ec;
-        auto status = std::filesystem::status(newPath, ec);
-        assert(!ec);
-        assert(status.type() == std::filesystem::file_type::directory);
         path = newPath;
         finder = FinderState(path);
         buf.Clear();
@@ -431,36 +682,39 @@ struct PathInputBox : BaseInputBox {
     return true;
   }
 
+  bool IsAnimating() const override {
+    // Entries stream into the finder while the directory is being listed
+    return finder && !finder->filter.isComplete;
+  }
+
   Color GetFinderBackgroundColor() { return GRAY; }
   Color GetFinderBorderColor() { return DARKGRAY; }
 
-  void DrawFinder(Font font, Rectangle rect) {
+  void DrawFinder(UI_RenderLayers &layers, Font font, Rectangle rect) {
     assert(finder.has_value());
-    DrawRectangle(rect.x, rect.y, rect.width, rect.height,
-                  GetFinderBackgroundColor());
-    DrawRectangleLines(rect.x, rect.y, rect.width, rect.height,
-                       GetFinderBorderColor());
+    layers.PushRectangle(LAYER_FINDER, rect, GetFinderBackgroundColor());
+    layers.PushRectangleLines(LAYER_FINDER, rect, GetFinderBorderColor());
 
     float y = rect.y + 2;
     auto &filter = finder->filter;
-    for (size_t i = 0; i < filter.subDirectories.size(); i++) {
-      if (filter.filteredEntries.count(i) != 0)
-        continue;
-      auto &entry = filter.subDirectories[i];
-      auto path = entry.path().filename().u8string();
-      if (path.empty()) {
-        // Filename is be empty when the entry refers to a Windows drive
-        path = entry.path().u8string();
-      }
-      auto t = MeasureTextEx(font, path.c_str(), TEXT_HEIGHT, 2);
+    filter.Poll();
+    for (size_t i = filter.idxBegin; i < filter.idxEnd; i++) {
+      auto &name = filter.names[i];
+      auto t = MeasureTextEx(font, name.c_str(), TEXT_HEIGHT, 2);
 
       if (y + t.y >= rect.y + rect.height) {
         break;
       }
 
-      DrawTextEx(font, path.c_str(), {rect.x + 2, y}, TEXT_HEIGHT, 2, BLACK);
+      layers.PushText(LAYER_FINDER, font, name.c_str(), {rect.x + 2, y},
+                      TEXT_HEIGHT, 2, BLACK);
       y += t.y;
     }
+
+    if (!filter.isComplete && y + TEXT_HEIGHT < rect.y + rect.height) {
+      layers.PushText(LAYER_FINDER, font, "...", {rect.x + 2, y}, TEXT_HEIGHT,
+                      2, DARKGRAY);
+    }
   }
 
   void Draw(UI_RenderLayers &layers,
@@ -474,13 +728,10 @@ struct PathInputBox : BaseInputBox {
     auto strPath = path.u8string();
     auto t0 = MeasureTextEx(font, strPath.c_str(), TEXT_HEIGHT, 2);
 
-    layers.Push(LAYER_INPUTBOXES,
-                [this, font, rect, strPath = move(strPath), textColor]() {
-                  DrawBox(rect);
-                  DrawTextEx(font, strPath.c_str(),
-                             {rect.x + TEXT_OFFSET.x, rect.y + TEXT_OFFSET.y},
-                             TEXT_HEIGHT, 2, textColor);
-                });
+    PushBox(layers, LAYER_INPUTBOXES, rect);
+    layers.PushText(LAYER_INPUTBOXES, font, strPath.c_str(),
+                    {rect.x + TEXT_OFFSET.x, rect.y + TEXT_OFFSET.y},
+                    TEXT_HEIGHT, 2, textColor);
 
     float x = rect.x + TEXT_OFFSET.x + t0.x + 2;
     float y = rect.y + TEXT_OFFSET.y;
@@ -494,13 +745,10 @@ struct PathInputBox : BaseInputBox {
       auto strEditedElem = "/" + std::string(buf.c_str());
 #endif
       t1 = MeasureTextEx(font, strEditedElem.c_str(), TEXT_HEIGHT, 2);
-      layers.Push(LAYER_INPUTBOXES, [this, font, rect,
-                                     strEditedElem = move(strEditedElem),
-                                     textColor, x, y, t1]() {
-        DrawTextEx(font, strEditedElem.c_str(), {x, y}, TEXT_HEIGHT, 2,
-                   textColor);
-        DrawLine(x, y + t1.y - 2, x + t1.x, y + t1.y - 2, textColor);
-      });
+      layers.PushText(LAYER_INPUTBOXES, font, strEditedElem.c_str(), {x, y},
+                      TEXT_HEIGHT, 2, textColor);
+      layers.PushLine(LAYER_INPUTBOXES, {x, y + t1.y - 2},
+                      {x + t1.x, y + t1.y - 2}, textColor);
     }
 
     if (finder) {
@@ -521,24 +769,59 @@ struct PathInputBox : BaseInputBox {
       rectFinder.y = fy;
       rectFinder.width = width;
       rectFinder.height = height;
-      layers.Push(LAYER_INPUTBOXES,
-                  [this, font, rectFinder]() { DrawFinder(font, rectFinder); });
+      DrawFinder(layers, font, rectFinder);
     }
   }
 };
 
 struct UI_InputWindow {
-  enum { BUF_PATH = 0, BUF_FILENAME_PATTERN, BUF_PATTERN, BUF_MAX };
+  enum {
+    BUF_PATH = 0,
+    BUF_FILENAME_PATTERN,
+    // Include/exclude rules on paths, sizes and ages; see PathRules
+    BUF_PATH_RULES,
+    BUF_PATTERN,
+    // Only used in replace mode
+    BUF_REPLACEMENT,
+    // Narrows down the results of the current request; edits don't start a
+    // new request
+    BUF_REFINE,
+    BUF_MAX
+  };
   std::unique_ptr<BaseInputBox> inputBoxes[BUF_MAX];
 
   std::optional<size_t> idxEditedField;
   Font font;
   UI_RenderLayers *layers;
 
+  bool ignoreCase = false;
+  bool fixedString = false;
+  bool multiline = false;
+  int numContextLines = 2;
+  bool replace = false;
+  // Files are only written once this is unchecked
+  bool dryRun = true;
+  int outputMode = OUTPUT_MATCHES;
+  // 0 for no limit. The spinners can be typed into after clicking them.
+  int maxCount = 0;
+  int maxCountPerFile = 0;
+  bool editingMaxCount = false;
+  bool editingMaxCountPerFile = false;
+  int sortMode = SORT_NONE;
+  bool groupByDirectory = false;
+  // Capture group highlighted in the results
+  int idxGroupShown = 0;
+  bool refineInvalid = false;
+  int followSymlinks = SYMLINKS_ROOT_ONLY;
+  bool dedupeFiles = true;
+
   UI_InputWindow() : idxEditedField(std::nullopt), font({}), layers(nullptr) {
     inputBoxes[BUF_PATH] = std::make_unique<PathInputBox>();
     inputBoxes[BUF_FILENAME_PATTERN] = std::make_unique<InputBox>();
+    inputBoxes[BUF_PATH_RULES] = std::make_unique<InputBox>();
     inputBoxes[BUF_PATTERN] = std::make_unique<InputBox>();
+    inputBoxes[BUF_REPLACEMENT] = std::make_unique<InputBox>();
+    inputBoxes[BUF_REFINE] = std::make_unique<InputBox>();
   }
 
   void SetEditedField(std::optional<size_t> idx) {
@@ -574,10 +857,17 @@ struct UI_InputWindow {
       inputBoxes[BUF_PATTERN]->SetInvalid(state->status == UI_MRSBadPattern);
       inputBoxes[BUF_FILENAME_PATTERN]->SetInvalid(state->status ==
                                                    UI_MRSBadFilenamePattern);
+      inputBoxes[BUF_PATH_RULES]->SetInvalid(state->status ==
+                                             UI_MRSBadPathRules);
+      inputBoxes[BUF_REPLACEMENT]->SetInvalid(state->status ==
+                                              UI_MRSBadReplacement);
     } else {
       inputBoxes[BUF_PATTERN]->SetInvalid(false);
       inputBoxes[BUF_FILENAME_PATTERN]->SetInvalid(false);
+      inputBoxes[BUF_PATH_RULES]->SetInvalid(false);
+      inputBoxes[BUF_REPLACEMENT]->SetInvalid(false);
     }
+    inputBoxes[BUF_REFINE]->SetInvalid(refineInvalid);
 
     if (idxEditedField) {
       auto charEntered = GetCharPressed();
@@ -596,7 +886,9 @@ struct UI_InputWindow {
         switch (keyPressed) {
           case KEY_ENTER:
           case KEY_KP_ENTER:
-            ret = ACTION_APPLY;
+            if (*idxEditedField != BUF_REFINE) {
+              ret = ACTION_APPLY;
+            }
             break;
           case KEY_TAB:
             if (IsKeyDown(KEY_LEFT_SHIFT)) {
@@ -638,15 +930,105 @@ struct UI_InputWindow {
       rect.width = std::min(64, GetScreenWidth() / 4);
       if (GuiButton(rect, "Abort")) {
         if (state) {
-          auto expected = UI_MRSPending;
-          state->status.compare_exchange_strong(expected, UI_MRSAborted);
+          state->Abort();
         }
       }
+
+      Rectangle rectCheckBox;
+      rectCheckBox.x = rect.x + rect.width + PADDING_HORI * 2;
+      rectCheckBox.y = rect.y + 2;
+      rectCheckBox.width = INPUT_HEIGHT - 4;
+      rectCheckBox.height = INPUT_HEIGHT - 4;
+      ignoreCase = GuiCheckBox(rectCheckBox, "Ignore case", ignoreCase);
+      rectCheckBox.x += CHECKBOX_STRIDE;
+      fixedString = GuiCheckBox(rectCheckBox, "Fixed string", fixedString);
+      rectCheckBox.x += CHECKBOX_STRIDE;
+      multiline = GuiCheckBox(rectCheckBox, "Multiline", multiline);
+
+      // The spinner draws its label to its left
+      Rectangle rectSpinner;
+      rectSpinner.x = rectCheckBox.x + CHECKBOX_STRIDE + 48;
+      rectSpinner.y = rect.y;
+      rectSpinner.width = 64;
+      rectSpinner.height = INPUT_HEIGHT;
+      GuiSpinner(rectSpinner, "Context", &numContextLines, 0, 10, false);
+
+      rectCheckBox.x = rectSpinner.x + rectSpinner.width + PADDING_HORI * 2;
+      replace = GuiCheckBox(rectCheckBox, "Replace", replace);
+      rectCheckBox.x += CHECKBOX_STRIDE;
+      dryRun = GuiCheckBox(rectCheckBox, "Dry run", dryRun);
+
+      Rectangle rectCombo = rect;
+      rectCombo.x = rectCheckBox.x + CHECKBOX_STRIDE;
+      rectCombo.width = 128;
+      outputMode = GuiComboBox(
+          rectCombo,
+          "All matches;Files with matches;Files without match;Count only",
+          outputMode);
+
+      rectSpinner.x = rectCombo.x + rectCombo.width + PADDING_HORI * 2 + 64;
+      rectSpinner.width = 80;
+      if (GuiSpinner(rectSpinner, "Max total", &maxCount, 0, MAX_MATCH_LIMIT,
+                     editingMaxCount)) {
+        editingMaxCount = !editingMaxCount;
+      }
+      rectSpinner.x += rectSpinner.width + PADDING_HORI * 2 + 56;
+      if (GuiSpinner(rectSpinner, "Per file", &maxCountPerFile, 0,
+                     MAX_MATCH_LIMIT, editingMaxCountPerFile)) {
+        editingMaxCountPerFile = !editingMaxCountPerFile;
+      }
+    }
+
+    {
+      // Only changes how the results are displayed; no new request is made
+      auto rect = GetButtonRect(pos, size, BUF_MAX + 1);
+      rect.width = 128;
+      sortMode = GuiComboBox(
+          rect, "Unsorted;By path;Most matches;Newest;Largest", sortMode);
+
+      Rectangle rectCheckBox;
+      rectCheckBox.x = rect.x + rect.width + PADDING_HORI * 2;
+      rectCheckBox.y = rect.y + 2;
+      rectCheckBox.width = INPUT_HEIGHT - 4;
+      rectCheckBox.height = INPUT_HEIGHT - 4;
+      groupByDirectory =
+          GuiCheckBox(rectCheckBox, "Group by directory", groupByDirectory);
+
+      // Unlike the view settings to their left, these apply to the next
+      // request
+      Rectangle rectCombo = rect;
+      rectCombo.x = rectCheckBox.x + CHECKBOX_STRIDE * 1.5f;
+      followSymlinks = GuiComboBox(
+          rectCombo, "Skip symlinks;Follow root link;Follow symlinks",
+          followSymlinks);
+
+      rectCheckBox.x = rectCombo.x + rectCombo.width + PADDING_HORI * 2;
+      dedupeFiles = GuiCheckBox(rectCheckBox, "Skip hardlinks", dedupeFiles);
+
+      // Only changes the highlighting, like the settings left of the symlink
+      // policy
+      Rectangle rectSpinner;
+      rectSpinner.x = rectCheckBox.x + CHECKBOX_STRIDE + 48;
+      rectSpinner.y = rect.y;
+      rectSpinner.width = 64;
+      rectSpinner.height = INPUT_HEIGHT;
+      GuiSpinner(rectSpinner, "Group", &idxGroupShown, 0, MAX_SHOWN_GROUP,
+                 false);
     }
 
     return ret;
   }
 
+  // Whether the next frame differs even without input
+  bool IsAnimating() const {
+    for (auto &inputBox : inputBoxes) {
+      if (inputBox->IsAnimating()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
   Rectangle GetButtonRect(const Vector2 &pos, const Vector2 &size, int idx) {
     Rectangle ret;
     ret.x = PADDING_HORI;
@@ -657,129 +1039,203 @@ struct UI_InputWindow {
   }
 };
 
-static void DrawResults(UI_MatchRequestState *state,
+// Range of the matching line taken by group `idxGroup` of `match`, 0 being the
+// whole match. Returns false if the group didn't participate in the match or
+// lies past the part of the lines that was captured.
+static bool GetGroupRange(const Match &match,
+                          uint32_t idxGroup,
+                          size_t &offStart,
+                          size_t &offEnd) {
+  if (idxGroup == 0) {
+    offStart = match.idxColumn;
+    offEnd = match.idxColumn + (match.offEnd - match.offStart);
+  } else if (idxGroup <= match.numGroups &&
+             match.groups[idxGroup - 1].offStart != MATCH_GROUP_UNSET) {
+    offStart = match.groups[idxGroup - 1].offStart;
+    offEnd = match.groups[idxGroup - 1].offEnd;
+  } else {
+    return false;
+  }
+
+  offStart = std::min(offStart, match.lenSnippetLine);
+  offEnd = std::min(offEnd, match.lenSnippetLine);
+  return offStart < offEnd;
+}
+
+static void DrawResults(const UI_MatchRequestState *state,
+                        const ResultView &view,
                         const Font &font,
+                        uint32_t idxGroup,
                         float &scrollY,
-                        PreviewState &preview) {
+                        PreviewState &preview,
+                        TextLayoutCache &layoutCache) {
   ZoneScoped;
 
-  const int top = 128;
+  const int top = 172;
   const int bottom = GetScreenHeight();
-
-  const int viewportTop = top + scrollY;
-  const int viewportBottom = bottom + scrollY;
-
-  int y = top;
-  bool bottomRendered = true;
+  const float heightViewport = bottom - top;
 
   DrawRectangleLines(0, top, GetScreenWidth(), bottom - top, BLACK);
 
-  auto L = std::unique_lock<std::mutex>(state->lockFiles);
   bool mouseWasHoveringAboveALine = false;
 
   auto &files = state->files;
-  for (auto &file : files) {
+  // Layouts are keyed by file, so they survive reordering but not a new request
+  if (layoutCache.idRequest != state->idRequest ||
+      layoutCache.idxGroup != idxGroup) {
+    layoutCache.Clear();
+    layoutCache.idRequest = state->idRequest;
+    layoutCache.idxGroup = idxGroup;
+  }
+
+  const Font fontResults = GetFontDefault();
+  layoutCache.BeginFrame(fontResults, RESULT_TEXT_HEIGHT);
+
+  const float maxScrollY =
+      std::max(0.0f, view.numRows * ROW_HEIGHT - heightViewport);
+  scrollY = std::min(scrollY, maxScrollY);
+
+  Rectangle rectScrollBar;
+  rectScrollBar.x = GetScreenWidth() - SCROLLBAR_WIDTH;
+  rectScrollBar.y = top;
+  rectScrollBar.width = SCROLLBAR_WIDTH;
+  rectScrollBar.height = heightViewport;
+  auto scrollBarValue =
+      GuiScrollBar(rectScrollBar, (int)scrollY, 0, (int)maxScrollY);
+  if (scrollBarValue != (int)scrollY) {
+    scrollY = scrollBarValue;
+  }
+
+  // Rows that are partially scrolled out at the top are not drawn
+  size_t idxRow = (size_t)std::ceil(scrollY / ROW_HEIGHT);
+  size_t idxEntry, idxRowInEntry;
+  bool hasRow = view.Find(idxEntry, idxRowInEntry, idxRow);
+
+  while (hasRow) {
     ZoneScoped;
-    auto width = MeasureText(file.path.c_str(), 10);
-    if (viewportTop <= y && y <= viewportBottom) {
-      DrawText(file.path.c_str(), 0, y - scrollY, 10, DARKGRAY);
-    }
-    y += 16;
-    size_t idxMatch = 0;
-    for (auto &match : file.matches) {
-      ZoneScoped;
-      if (viewportTop <= y && y <= viewportBottom) {
-        if (idxMatch >= file.uiCache.size()) {
-          if (file.mmap == nullptr) {
-            Mmap_Open(file.mmap, file.path);
-            // TODO(danielm): handle failure
-          }
-          assert(file.mmap != nullptr);
-          size_t len;
-          const void *contents = nullptr;
-          assert(match.idxLine < file.lineInfo.size());
-          auto &line = file.lineInfo[match.idxLine];
-          Mmap_Map(contents, len, file.mmap, line.offStart,
-                   line.offEnd - line.offStart);
-          assert(contents != nullptr);
-          fmt::string_view lineContent((const char *)contents,
-                                       line.offEnd - line.offStart - 1);
-          file.uiCache.resize(idxMatch + 1);
-          assert(idxMatch < file.uiCache.size());
-          file.uiCache[idxMatch] =
-              fmt::format("  L#{}: '{}'\n", match.idxLine + 1, lineContent);
-          Mmap_Unmap(file.mmap);
-        }
-        auto tm = MeasureTextEx(GetFontDefault(),
-                                file.uiCache[idxMatch].c_str(), 10, 2);
-        DrawText(file.uiCache[idxMatch].c_str(), 10, y - scrollY, 10, BLACK);
-
-        // Test for cursor hover and draw the line context
-        Rectangle rectLine;
-        rectLine.x = 10;
-        rectLine.width = tm.x;
-        rectLine.y = y - scrollY;
-        rectLine.height = 16;
-        auto cursor = GetMousePosition();
-        if (CheckCollisionPointRec(cursor, rectLine)) {
-          mouseWasHoveringAboveALine = true;
-          if (preview.path != file.path || preview.idxMatch != idxMatch) {
-            preview.contents.reset();
-          }
+    auto &entry = view.entries[idxEntry];
+    size_t idxFile = entry.idxFile;
+    size_t idxRowInFile = idxRowInEntry;
+    auto &file = files[idxFile];
+    float y = top + idxRow * ROW_HEIGHT - scrollY;
+    if (y > bottom) {
+      break;
+    }
 
-          if (!preview.contents) {
-            if (file.mmap == nullptr) {
-              Mmap_Open(file.mmap, file.path);
-              // TODO(danielm): handle failure
+    if (entry.isDirectoryHeader) {
+      auto key = TextLayoutCache::MakeKey(idxFile, UINT32_MAX);
+      auto &layout =
+          layoutCache.Get(key, fontResults, RESULT_TEXT_SPACING, [&]() {
+            auto offSeparator = file.path.find_last_of("/\\");
+            if (offSeparator == std::string::npos) {
+              return std::string(".");
+            }
+            return file.path.substr(0, offSeparator);
+          });
+      layout.Draw(fontResults, RESULT_TEXT_HEIGHT, {0, y}, DARKBLUE);
+
+      idxRow++;
+      idxEntry++;
+      idxRowInEntry = 0;
+      hasRow = idxEntry < view.entries.size();
+      continue;
+    }
+
+    if (idxRowInFile == 0) {
+      auto key = TextLayoutCache::MakeKey(idxFile, 0);
+      auto &layout =
+          layoutCache.Get(key, fontResults, RESULT_TEXT_SPACING, [&]() {
+            if (file.numMatchesCounted > 0) {
+              return fmt::format("{} ({} matches)", file.path,
+                                 file.numMatchesCounted);
+            }
+            switch (file.replaceOutcome) {
+              case UI_ROWritten:
+                return file.path + " (rewritten)";
+              case UI_ROFailed:
+                return file.path + " (couldn't be rewritten)";
+              case UI_ROCompressed:
+                return file.path + " (compressed, can't be rewritten)";
+              default:
+                return file.path;
+            }
+          });
+      layout.Draw(fontResults, RESULT_TEXT_HEIGHT, {0, y}, DARKGRAY);
+    } else {
+      size_t idxMatch = view.GetMatchIndex(entry, idxRowInFile - 1);
+      auto &match = file.matches[idxMatch];
+      auto key = TextLayoutCache::MakeKey(idxFile, 1 + idxMatch);
+      auto &layout =
+          layoutCache.Get(key, fontResults, RESULT_TEXT_SPACING, [&]() {
+            // Only the first line of a match spanning several is shown; the
+            // preview has the rest
+            auto *pLine = match.snippet + match.offSnippetLine;
+            auto *pNewline =
+                (const char *)memchr(pLine, '\n', match.lenSnippetLine);
+            fmt::string_view lineContent(
+                pLine, pNewline ? pNewline - pLine : match.lenSnippetLine);
+            HighlightedText text =
+                match.idxLineEnd == match.idxLine
+                    ? fmt::format("  L#{}: '", match.idxLine + 1)
+                    : fmt::format("  L#{}-{}: '", match.idxLine + 1,
+                                  match.idxLineEnd + 1);
+            auto offLine = text.text.size();
+            text.text.append(lineContent.data(), lineContent.size());
+            text.text += '\'';
+            if (match.replacement != nullptr) {
+              text.text += " -> '";
+              text.text.append(match.replacement, match.lenReplacement);
+              text.text += '\'';
             }
-            assert(file.mmap != nullptr);
-            size_t len;
-            const void *contents = nullptr;
-            size_t idxFirstLine =
-                match.idxLine > 2 ? match.idxLine - 2 : match.idxLine;
-            size_t idxLastLine =
-                std::min(match.idxLine + 2, file.lineInfo.size() - 1);
-            auto &firstLine = file.lineInfo[idxFirstLine];
-            auto &lastLine = file.lineInfo[idxLastLine];
-            assert(firstLine.offStart <= lastLine.offEnd);
-            Mmap_Map(contents, len, file.mmap, firstLine.offStart,
-                     lastLine.offEnd - firstLine.offStart);
-            assert(contents != nullptr);
-            std::string lineContent((const char *)contents,
-                                    lastLine.offEnd - firstLine.offStart);
-            std::replace(lineContent.begin(), lineContent.end(), '\r', ' ');
-            preview.contents = lineContent;
-            preview.idxMatch = idxMatch;
-            preview.path = file.path;
-            Mmap_Unmap(file.mmap);
-          }
 
-          preview.position = cursor;
+            size_t offStart, offEnd;
+            if (GetGroupRange(match, idxGroup, offStart, offEnd)) {
+              text.offHighlightStart = offLine + offStart;
+              text.offHighlightEnd =
+                  offLine + std::min(offEnd, lineContent.size());
+            }
+            return text;
+          });
+      auto tm = layout.extents;
+      layout.Draw(fontResults, RESULT_TEXT_HEIGHT, {10, y}, BLACK);
+
+      // Test for cursor hover and draw the line context
+      Rectangle rectLine;
+      rectLine.x = 10;
+      rectLine.width = tm.x;
+      rectLine.y = y;
+      rectLine.height = ROW_HEIGHT;
+      auto cursor = GetMousePosition();
+      if (CheckCollisionPointRec(cursor, rectLine)) {
+        mouseWasHoveringAboveALine = true;
+        if (preview.path != file.path || preview.idxMatch != idxMatch ||
+            preview.idxGroup != idxGroup) {
+          preview.contents.reset();
         }
-      }
 
-      y += 16;
-      idxMatch++;
+        if (!preview.contents) {
+          preview.contents = std::string(match.snippet, match.lenSnippet);
+          preview.idxMatch = idxMatch;
+          preview.idxGroup = idxGroup;
+          preview.path = file.path;
+          size_t offStart = 0, offEnd = 0;
+          GetGroupRange(match, idxGroup, offStart, offEnd);
+          preview.layout.Shape(font, TEXT_HEIGHT, 2, preview.contents->c_str(),
+                               match.offSnippetLine + offStart,
+                               match.offSnippetLine + offEnd);
+        }
 
-      if (y > viewportBottom) {
-        bottomRendered = false;
-        break;
+        preview.position = cursor;
       }
     }
 
-    if (file.mmap != nullptr) {
-      Mmap_Close(file.mmap);
+    idxRow++;
+    idxRowInEntry++;
+    if (idxRowInEntry > entry.numMatches) {
+      idxEntry++;
+      idxRowInEntry = 0;
+      hasRow = idxEntry < view.entries.size();
     }
-
-    if (y > viewportBottom) {
-      bottomRendered = false;
-      break;
-    }
-  }
-
-  if (bottomRendered) {
-    float maxY = y;
-    scrollY = std::min(scrollY, maxY);
   }
 
   if (!mouseWasHoveringAboveALine) {
@@ -788,12 +1244,38 @@ static void DrawResults(UI_MatchRequestState *state,
 
   if (preview.contents) {
     auto pos = preview.position;
-    auto tm = MeasureTextEx(font, preview.contents->c_str(), TEXT_HEIGHT, 2);
+    auto tm = preview.layout.extents;
     DrawRectangle(pos.x, pos.y, tm.x, tm.y, GRAY);
-    DrawTextEx(font, preview.contents->c_str(), pos, TEXT_HEIGHT, 2, BLACK);
+    preview.layout.Draw(font, TEXT_HEIGHT, pos, BLACK);
   }
 }
 
+// Looks at the input polled last without consuming any of it
+static bool HasInput(Vector2 &mousePositionPrev) {
+  auto mousePosition = GetMousePosition();
+  bool mouseMoved = mousePosition.x != mousePositionPrev.x ||
+                    mousePosition.y != mousePositionPrev.y;
+  mousePositionPrev = mousePosition;
+  if (mouseMoved || GetMouseWheelMove() != 0) {
+    return true;
+  }
+
+  for (int button = MOUSE_BUTTON_LEFT; button <= MOUSE_BUTTON_MIDDLE;
+       button++) {
+    if (IsMouseButtonDown(button) || IsMouseButtonReleased(button)) {
+      return true;
+    }
+  }
+
+  for (int key = KEY_SPACE; key <= KEY_KB_MENU; key++) {
+    if (IsKeyDown(key) || IsKeyReleased(key)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 static void threadprocUi(UI_DataSource *dataSource, void *user) {
   SetConfigFlags(FLAG_WINDOW_RESIZABLE);
   InitWindow(540, 580, "boringrep");
@@ -814,6 +1296,11 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
 #endif
 
   PreviewState preview;
+  TextLayoutCache layoutCache;
+  // Results in the order they were published; shown until the builder has
+  // caught up with the current request and sort settings
+  ResultView unsortedView;
+  ViewBuilder viewBuilder;
 
   auto cwd = std::filesystem::current_path().string();
   inputBox.inputBoxes[UI_InputWindow::BUF_PATH] =
@@ -824,14 +1311,44 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
 
   bool wasFocused = IsWindowFocused();
 
+  // What the last frame showed; frames are only drawn when something changed
+  // since then, otherwise the thread sleeps between input polls
+  bool needsRedraw = true;
+  uint64_t idRequestDrawn = 0;
+  uint64_t generationDrawn = 0;
+  uint64_t viewGenerationDrawn = 0;
+  Vector2 mousePositionPrev = GetMousePosition();
+
   while (!WindowShouldClose()) {
     bool isFocused = IsWindowFocused();
     if (wasFocused && !isFocused) {
       SetTargetFPS(5);
+      needsRedraw = true;
     } else if (!wasFocused && isFocused) {
       SetTargetFPS(60);
+      needsRedraw = true;
     }
     wasFocused = isFocused;
+
+    {
+      auto *state = dataSource->getCurrentState(user);
+      uint64_t idRequest = state ? state->idRequest : 0;
+      uint64_t generation = state ? state->generation.load() : 0;
+      needsRedraw = needsRedraw || HasInput(mousePositionPrev) ||
+                    IsWindowResized() || scrollVel != 0 ||
+                    inputBox.IsAnimating() || idRequest != idRequestDrawn ||
+                    generation != generationDrawn ||
+                    viewBuilder.GetGeneration() != viewGenerationDrawn;
+    }
+
+    if (!needsRedraw) {
+      ZoneScopedN("Idle");
+      WaitTime(isFocused ? IDLE_POLL_MS : IDLE_POLL_MS_UNFOCUSED);
+      PollInputEvents();
+      continue;
+    }
+    needsRedraw = false;
+
     BeginDrawing();
     ClearBackground(RAYWHITE);
 
@@ -843,6 +1360,7 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
         if (state) {
           aborted = state->status == UI_MRSAborted;
           if (aborted) {
+            viewBuilder.Forget(state);
             dataSource->discardOldestState(user);
           }
         }
@@ -868,6 +1386,7 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
           if (state) {
             finished = state->status != UI_MRSPending;
             if (finished) {
+              viewBuilder.Forget(state);
               dataSource->discardOldestState(user);
             }
           }
@@ -879,8 +1398,24 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
         request.patternFilename =
             inputBox.inputBoxes[UI_InputWindow::BUF_FILENAME_PATTERN]
                 ->GetString();
+        request.pathRules =
+            inputBox.inputBoxes[UI_InputWindow::BUF_PATH_RULES]->GetString();
         request.pattern =
             inputBox.inputBoxes[UI_InputWindow::BUF_PATTERN]->GetString();
+        request.caseInsensitive = inputBox.ignoreCase;
+        request.fixedString = inputBox.fixedString;
+        request.multiline = inputBox.multiline;
+        request.numContextBefore = inputBox.numContextLines;
+        request.numContextAfter = inputBox.numContextLines;
+        request.replace = inputBox.replace;
+        request.replacement =
+            inputBox.inputBoxes[UI_InputWindow::BUF_REPLACEMENT]->GetString();
+        request.dryRun = inputBox.dryRun;
+        request.outputMode = (OutputMode)inputBox.outputMode;
+        request.maxCount = inputBox.maxCount;
+        request.maxCountPerFile = inputBox.maxCountPerFile;
+        request.followSymlinks = (SymlinkPolicy)inputBox.followSymlinks;
+        request.dedupeFiles = inputBox.dedupeFiles;
         dataSource->putRequest(user, std::move(request));
         break;
       }
@@ -895,20 +1430,47 @@ static void threadprocUi(UI_DataSource *dataSource, void *user) {
     }
 
     state = dataSource->getCurrentState(user);
+    idRequestDrawn = state ? state->idRequest : 0;
+    generationDrawn = state ? state->generation.load() : 0;
+    viewGenerationDrawn = viewBuilder.GetGeneration();
+    ViewParams viewParams;
+    viewParams.sortMode = (SortMode)inputBox.sortMode;
+    viewParams.groupByDirectory = inputBox.groupByDirectory;
+    viewParams.filter =
+        inputBox.inputBoxes[UI_InputWindow::BUF_REFINE]->GetString();
+    viewParams.filterCaseless = inputBox.ignoreCase;
+    viewBuilder.SetSource(state, viewParams);
+    inputBox.refineInvalid = viewBuilder.IsFilterInvalid();
     if (state) {
+      auto frameTime = std::min(GetFrameTime(), MAX_FRAME_TIME);
       scrollVel = scrollVel + 5 * GetMouseWheelMove();
       if (scrollVel != 0) {
-        scrollVel -= GetFrameTime() * 0.5f * scrollVel;
+        scrollVel -= frameTime * 0.5f * scrollVel;
       }
 
-      scrollY += scrollVel * GetFrameTime();
+      scrollY += scrollVel * frameTime;
       scrollY = std::max(0.0f, scrollY);
 
-      if (scrollY == 0.0f) {
+      if (scrollY == 0.0f || std::abs(scrollVel) < MIN_SCROLL_VELOCITY) {
         scrollVel = 0.0f;
       }
 
-      DrawResults(state, inputBox.font, scrollY, preview);
+      unsortedView.AppendNewFiles(state);
+      const ResultView *view = &unsortedView;
+      auto builtView = viewBuilder.GetView();
+      // A view built with the previous parameters is kept on screen for the
+      // frame or two it takes to build the new one; falling back to the
+      // unsorted view in between would make the list flicker while typing a
+      // refine pattern
+      if (!viewParams.IsIdentity() && builtView &&
+          builtView->idRequest == state->idRequest) {
+        view = builtView.get();
+      }
+
+      DrawResults(state, *view, inputBox.font, inputBox.idxGroupShown, scrollY,
+                  preview, layoutCache);
+    } else {
+      scrollVel = 0.0f;
     }
 
     FrameMark;
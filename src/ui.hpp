@@ -1,19 +1,34 @@
 #pragma once
 
 #include <atomic>
+#include <functional>
 #include <mutex>
 
+#include "arena.hpp"
 #include "data.hpp"
-#include "mmap.hpp"
+#include "segarray.hpp"
+
+enum UI_ReplaceOutcome {
+  UI_ROUntouched = 0,
+  UI_ROWritten,
+  // The file couldn't be written or changed after it was searched
+  UI_ROFailed,
+  // Compressed files are only ever previewed, also outside of a dry run
+  UI_ROCompressed,
+};
 
 struct UI_File {
   std::string path;
   std::vector<Match> matches;
-  std::vector<LineInfo> lineInfo;
+  // Backs the snippets of the matches
+  Arena snippets;
 
-  std::vector<std::string> uiCache;
-
-  MemoryMapHandle mmap = nullptr;
+  uint64_t size = 0;
+  // Only meaningful for comparisons
+  int64_t mtime = 0;
+  UI_ReplaceOutcome replaceOutcome = UI_ROUntouched;
+  // In count mode, the number of matches; `matches` stays empty
+  uint64_t numMatchesCounted = 0;
 };
 
 enum UI_MatchRequestStatus {
@@ -22,13 +37,57 @@ enum UI_MatchRequestStatus {
 	UI_MRSAborted,
 	UI_MRSBadFilenamePattern,
 	UI_MRSBadPattern,
+	UI_MRSBadPathRules,
+	UI_MRSBadReplacement,
 	UI_MRSFailure,
 };
 
 struct UI_MatchRequestState {
+  // Unique for each request; state objects themselves may be reallocated at
+  // the same address
+  uint64_t idRequest = 0;
   std::atomic<UI_MatchRequestStatus> status;
-  std::mutex lockFiles;
-  std::vector<UI_File> files;
+  // Length of the request's root directory, which the paths of all files
+  // start with; set before the state is shared
+  size_t lenPathRoot = 0;
+  // Appended to by the search thread only. The UI thread may only touch the
+  // UI-side fields of a published file.
+  SegmentedArray<UI_File> files;
+  // Bumped whenever a file is published or the status changes; the UI only
+  // redraws when this (or its input) changed since the last frame
+  std::atomic<uint64_t> generation{0};
+  // Lets the search thread sleep while it waits for its workers; called when
+  // the request is aborted
+  std::mutex lockAbortHandler;
+  std::function<void()> abortHandler;
+
+  void Publish(UI_File &&file) {
+    files.push_back(std::move(file));
+    generation++;
+  }
+
+  void SetStatus(UI_MatchRequestStatus status) {
+    this->status = status;
+    generation++;
+  }
+
+  // Aborts the request if it is still pending; may be called from any thread
+  void Abort() {
+    auto expected = UI_MRSPending;
+    if (!status.compare_exchange_strong(expected, UI_MRSAborted)) {
+      return;
+    }
+    generation++;
+    std::lock_guard G(lockAbortHandler);
+    if (abortHandler) {
+      abortHandler();
+    }
+  }
+
+  void SetAbortHandler(std::function<void()> &&handler) {
+    std::lock_guard G(lockAbortHandler);
+    abortHandler = std::move(handler);
+  }
 };
 
 using UI_PfnExit = void (*)(void* user);
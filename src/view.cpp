@@ -0,0 +1,574 @@
+#include "view.hpp"
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <string_view>
+
+#include <fmt/core.h>
+
+#include "BTracy.hpp"
+#include "scan.hpp"
+
+enum {
+  // Upper bound of the files whose sort keys are copied in one go; the source
+  // state is locked while this happens
+  VIEW_MAX_KEYS_PER_BATCH = 64 * 1024,
+  // Batches smaller than this are processed on the builder thread alone
+  VIEW_MIN_PARALLEL_CHUNK = 16 * 1024,
+  VIEW_POLL_INTERVAL_MS = 50,
+};
+
+void ResultView::Clear(uint64_t idRequest) {
+  this->idRequest = idRequest;
+  numFiles = 0;
+  entries.clear();
+  rowStart.clear();
+  numRows = 0;
+}
+
+void ResultView::Append(const ResultViewEntry &entry) {
+  entries.push_back(entry);
+  rowStart.push_back(numRows);
+  numRows += entry.isDirectoryHeader ? 1 : 1 + entry.numMatches;
+}
+
+void ResultView::AppendNewFiles(const UI_MatchRequestState *state) {
+  ZoneScoped;
+  if (state->idRequest != idRequest) {
+    Clear(state->idRequest);
+  }
+
+  auto &files = state->files;
+  auto numFilesNow = files.size();
+  for (; numFiles < numFilesNow; numFiles++) {
+    Append({(uint32_t)numFiles, (uint32_t)files[numFiles].matches.size(), 0,
+            false});
+  }
+}
+
+bool ResultView::Find(size_t &idxEntry,
+                      size_t &idxRowInEntry,
+                      size_t idxRow) const {
+  if (idxRow >= numRows) {
+    return false;
+  }
+
+  auto it = std::upper_bound(rowStart.begin(), rowStart.end(), idxRow);
+  assert(it != rowStart.begin());
+  idxEntry = std::distance(rowStart.begin(), it) - 1;
+  idxRowInEntry = idxRow - rowStart[idxEntry];
+  return true;
+}
+
+// Matches the refine pattern against paths and match lines. Plain literals go
+// through the SIMD scanner, everything else through PCRE2.
+struct RefineFilter {
+  std::optional<ScanNeedle> literal;
+  pcre2_code *pattern = nullptr;
+
+  ~RefineFilter() {
+    if (pattern) {
+      pcre2_code_free(pattern);
+    }
+  }
+
+  bool Compile(const std::string &filter, bool caseless) {
+    std::string str;
+    bool inlineCaseless = false;
+    bool isLiteral = Scan_ParseLiteral(str, inlineCaseless, filter);
+    caseless = caseless || inlineCaseless;
+    if (isLiteral && (!caseless || Scan_IsAscii(str))) {
+      literal = Scan_MakeNeedle(str, caseless);
+      return true;
+    }
+
+    uint32_t options = caseless ? PCRE2_CASELESS : 0;
+    if (caseless && !Scan_IsAscii(filter)) {
+      options |= PCRE2_UTF | PCRE2_MATCH_INVALID_UTF;
+    }
+    int rc;
+    size_t offError;
+    pattern = pcre2_compile((PCRE2_SPTR8)filter.c_str(), filter.size(),
+                            options, &rc, &offError, nullptr);
+    if (!pattern) {
+      fmt::print("[view] bad filter rc={} offset={}\n", rc, offError);
+      return false;
+    }
+    return true;
+  }
+
+  // `matchData` must come from `pattern` and belong to the calling thread
+  bool Matches(const char *str, size_t len, pcre2_match_data *matchData) const {
+    if (literal) {
+      return Scan_Find(*literal, str, len, 0) != SCAN_NPOS;
+    }
+    return pcre2_match(pattern, (PCRE2_SPTR8)str, len, 0, 0, matchData,
+                       nullptr) >= 0;
+  }
+};
+
+// Part of `path` below the root of the request, which is what the refine
+// pattern is matched against
+static std::string_view RelativePath(const UI_MatchRequestState *state,
+                                     const std::string &path) {
+  auto offRelPath = std::min(state->lenPathRoot, path.size());
+  if (offRelPath < path.size() &&
+      (path[offRelPath] == '/' || path[offRelPath] == '\\')) {
+    offRelPath++;
+  }
+  return std::string_view(path).substr(offRelPath);
+}
+
+static size_t NumChunks(size_t count) {
+  return std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                              count / VIEW_MIN_PARALLEL_CHUNK));
+}
+
+// Threads that work through the large batches together with the builder
+// thread. They stay parked between batches.
+struct ViewHelpers {
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::condition_variable cvDone;
+  bool shutdown = false;
+
+  // Guarded by `lock`; the tasks of the current Run() call
+  const std::function<void(size_t)> *task = nullptr;
+  size_t numTasks = 0;
+  size_t idxNextTask = 0;
+  size_t numTasksDone = 0;
+
+  explicit ViewHelpers(size_t numThreads) {
+    for (size_t i = 0; i < numThreads; i++) {
+      threads.emplace_back([this]() { ThreadProc(); });
+    }
+  }
+
+  ~ViewHelpers() {
+    {
+      std::lock_guard G(lock);
+      shutdown = true;
+      cv.notify_all();
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Calls `fn(i)` for every i in [0, numTasks) and returns once all calls
+  // returned; the calling thread takes part
+  void Run(size_t numTasks, const std::function<void(size_t)> &fn) {
+    std::unique_lock L(lock);
+    task = &fn;
+    this->numTasks = numTasks;
+    idxNextTask = 0;
+    numTasksDone = 0;
+    cv.notify_all();
+
+    RunTasks(L);
+    cvDone.wait(L, [&]() { return numTasksDone == this->numTasks; });
+    task = nullptr;
+  }
+
+  // Must be called with the lock held
+  void RunTasks(std::unique_lock<std::mutex> &L) {
+    while (task && idxNextTask < numTasks) {
+      auto *fn = task;
+      auto idxTask = idxNextTask++;
+      L.unlock();
+      (*fn)(idxTask);
+      L.lock();
+      if (++numTasksDone == numTasks) {
+        cvDone.notify_one();
+      }
+    }
+  }
+
+  void ThreadProc() {
+    tracy::SetThreadName("Thread-ViewWorker");
+    std::unique_lock L(lock);
+    while (true) {
+      cv.wait(L, [this]() {
+        return shutdown || (task && idxNextTask < numTasks);
+      });
+      if (shutdown) {
+        return;
+      }
+      RunTasks(L);
+    }
+  }
+};
+
+// Splits [0, count) into NumChunks(count) ranges and calls
+// `fn(idxChunk, idxBegin, idxEnd)` for each of them, in parallel if there is
+// more than one
+template <typename Fn>
+static void ParallelFor(ViewBuilder &builder, size_t count, Fn &&fn) {
+  size_t numChunks = NumChunks(count);
+  if (numChunks == 1) {
+    fn(0, 0, count);
+    return;
+  }
+
+  builder.GetHelpers().Run(numChunks, [&](size_t i) {
+    fn(i, count * i / numChunks, count * (i + 1) / numChunks);
+  });
+}
+
+ViewBuilder::ViewBuilder() {
+  thread = std::thread([this]() { ThreadProc(); });
+}
+
+ViewBuilder::~ViewBuilder() {
+  {
+    std::lock_guard G(lock);
+    shutdown = true;
+    cv.notify_one();
+  }
+  thread.join();
+}
+
+void ViewBuilder::SetSource(const UI_MatchRequestState *state,
+                            const ViewParams &params) {
+  std::lock_guard G(lock);
+  auto id = state ? state->idRequest : 0;
+  if (state != source || id != idRequest || params != this->params) {
+    source = state;
+    idRequest = id;
+    this->params = params;
+    paramsChanged = true;
+    cv.notify_one();
+  }
+}
+
+void ViewBuilder::Forget(const UI_MatchRequestState *state) {
+  {
+    std::lock_guard G(lock);
+    if (source != state) {
+      return;
+    }
+    source = nullptr;
+    idRequest = 0;
+    paramsChanged = true;
+  }
+
+  // Wait for the builder to finish the batch it may be reading
+  std::lock_guard S(lockSource);
+}
+
+ViewHelpers &ViewBuilder::GetHelpers() {
+  if (!helpers) {
+    auto numThreads = std::max(1u, std::thread::hardware_concurrency());
+    helpers = std::make_unique<ViewHelpers>(numThreads - 1);
+  }
+  return *helpers;
+}
+
+std::shared_ptr<const ResultView> ViewBuilder::GetView() const {
+  return std::atomic_load(&view);
+}
+
+static std::string_view Directory(const ViewBuilder::SortKey &key) {
+  return std::string_view(key.path.data(), key.lenDirectory);
+}
+
+bool ViewBuilder::Less(uint32_t lhs, uint32_t rhs) const {
+  auto &a = keys[lhs];
+  auto &b = keys[rhs];
+
+  if (curParams.groupByDirectory) {
+    auto cmp = Directory(a).compare(Directory(b));
+    if (cmp != 0) {
+      return cmp < 0;
+    }
+  }
+
+  switch (curParams.sortMode) {
+    case SORT_PATH:
+      if (a.path != b.path) {
+        return a.path < b.path;
+      }
+      break;
+    case SORT_MATCH_COUNT: {
+      // At most one of the two is set
+      auto numA = a.numMatches + a.numMatchesCounted;
+      auto numB = b.numMatches + b.numMatchesCounted;
+      if (numA != numB) {
+        return numA > numB;
+      }
+      break;
+    }
+    case SORT_MTIME:
+      if (a.mtime != b.mtime) {
+        return a.mtime > b.mtime;
+      }
+      break;
+    case SORT_SIZE:
+      if (a.size != b.size) {
+        return a.size > b.size;
+      }
+      break;
+    case SORT_NONE:
+    case SORT_MAX:
+      break;
+  }
+
+  // Publication order breaks ties
+  return lhs < rhs;
+}
+
+void ViewBuilder::SortNewKeys(std::vector<uint32_t> &indices) {
+  ZoneScoped;
+  if (curParams.sortMode == SORT_NONE && !curParams.groupByDirectory) {
+    // Only filtering; the indices are already in publication order
+    return;
+  }
+
+  auto less = [this](uint32_t lhs, uint32_t rhs) { return Less(lhs, rhs); };
+
+  size_t numThreads = std::min<size_t>(std::thread::hardware_concurrency(),
+                                       indices.size() / VIEW_MIN_PARALLEL_CHUNK);
+  if (numThreads <= 1) {
+    std::sort(indices.begin(), indices.end(), less);
+    return;
+  }
+
+  // Sort equal chunks in parallel, then merge them pairwise
+  std::vector<size_t> bounds;
+  for (size_t i = 0; i <= numThreads; i++) {
+    bounds.push_back(indices.size() * i / numThreads);
+  }
+
+  GetHelpers().Run(numThreads, [&](size_t i) {
+    std::sort(indices.begin() + bounds[i], indices.begin() + bounds[i + 1],
+              less);
+  });
+
+  for (size_t width = 1; width < numThreads; width *= 2) {
+    for (size_t i = 0; i + width < numThreads; i += 2 * width) {
+      auto itFirst = indices.begin() + bounds[i];
+      auto itMiddle = indices.begin() + bounds[i + width];
+      auto itLast =
+          indices.begin() + bounds[std::min(i + 2 * width, numThreads)];
+      std::inplace_merge(itFirst, itMiddle, itLast, less);
+    }
+  }
+}
+
+void ViewBuilder::Publish() {
+  ZoneScoped;
+  auto ret = std::make_shared<ResultView>();
+  ret->idRequest = curIdRequest;
+  ret->params = curParams;
+  ret->numFiles = keys.size();
+  ret->entries.reserve(sorted.size());
+  ret->rowStart.reserve(sorted.size());
+
+  for (size_t i = 0; i < sorted.size(); i++) {
+    auto idxFile = sorted[i];
+    auto &key = keys[idxFile];
+    if (curParams.groupByDirectory &&
+        (i == 0 || Directory(keys[sorted[i - 1]]) != Directory(key))) {
+      ret->Append({idxFile, 0, 0, true});
+    }
+
+    auto offMatches = key.offMatches;
+    if (offMatches != VIEW_ALL_MATCHES) {
+      offMatches = (uint32_t)ret->matchIndices.size();
+      auto it = matchIndices.begin() + key.offMatches;
+      ret->matchIndices.insert(ret->matchIndices.end(), it,
+                               it + key.numMatches);
+    }
+    ret->Append({idxFile, (uint32_t)key.numMatches, offMatches, false});
+  }
+
+  std::atomic_store(&view, std::shared_ptr<const ResultView>(std::move(ret)));
+  generation++;
+}
+
+void ViewBuilder::MakeKeys(const UI_MatchRequestState *state,
+                           size_t idxBegin,
+                           size_t idxEnd) {
+  ZoneScoped;
+  bool needsPath = curParams.sortMode == SORT_PATH || curParams.groupByDirectory;
+  auto &files = state->files;
+  keys.resize(idxEnd);
+
+  // Each chunk collects the matches that passed the filter on its own; their
+  // offsets are made relative to `matchIndices` once all chunks are done
+  auto count = idxEnd - idxBegin;
+  std::vector<std::vector<uint32_t>> chunkMatchIndices(NumChunks(count));
+
+  ParallelFor(*this, count, [&](size_t idxChunk, size_t idxChunkBegin,
+                                size_t idxChunkEnd) {
+    auto &chunkMatches = chunkMatchIndices[idxChunk];
+    pcre2_match_data *matchData = nullptr;
+    if (filter && filter->pattern) {
+      matchData = pcre2_match_data_create_from_pattern(filter->pattern, nullptr);
+    }
+
+    for (auto idxFile = idxBegin + idxChunkBegin;
+         idxFile < idxBegin + idxChunkEnd; idxFile++) {
+      auto &file = files[idxFile];
+      auto &key = keys[idxFile];
+      if (needsPath) {
+        key.path = file.path;
+      }
+      auto offSeparator = key.path.find_last_of("/\\");
+      key.lenDirectory = (offSeparator == std::string::npos) ? 0 : offSeparator;
+      key.numMatches = file.matches.size();
+      key.numMatchesCounted = file.numMatchesCounted;
+      key.size = file.size;
+      key.mtime = file.mtime;
+      key.isVisible = true;
+      key.offMatches = VIEW_ALL_MATCHES;
+
+      auto relPath = RelativePath(state, file.path);
+      if (filter &&
+          !filter->Matches(relPath.data(), relPath.size(), matchData)) {
+        // The path doesn't match, so only the matching lines are shown
+        key.offMatches = (uint32_t)chunkMatches.size();
+        for (size_t idxMatch = 0; idxMatch < file.matches.size(); idxMatch++) {
+          auto &match = file.matches[idxMatch];
+          if (filter->Matches(match.snippet + match.offSnippetLine,
+                              match.lenSnippetLine, matchData)) {
+            chunkMatches.push_back((uint32_t)idxMatch);
+          }
+        }
+        key.numMatches = chunkMatches.size() - key.offMatches;
+        key.isVisible = key.numMatches > 0;
+      }
+    }
+
+    if (matchData) {
+      pcre2_match_data_free(matchData);
+    }
+  });
+
+  auto numChunks = chunkMatchIndices.size();
+  for (size_t idxChunk = 0; idxChunk < numChunks; idxChunk++) {
+    auto &chunkMatches = chunkMatchIndices[idxChunk];
+    auto offChunk = (uint32_t)matchIndices.size();
+    matchIndices.insert(matchIndices.end(), chunkMatches.begin(),
+                        chunkMatches.end());
+
+    // Same split as in ParallelFor
+    auto idxChunkBegin = idxBegin + count * idxChunk / numChunks;
+    auto idxChunkEnd = idxBegin + count * (idxChunk + 1) / numChunks;
+    for (auto idxFile = idxChunkBegin; idxFile < idxChunkEnd; idxFile++) {
+      auto &key = keys[idxFile];
+      if (key.offMatches != VIEW_ALL_MATCHES) {
+        key.offMatches += offChunk;
+      }
+    }
+  }
+}
+
+void ViewBuilder::ThreadProc() {
+  tracy::SetThreadName("Thread-ViewBuilder");
+
+  // Batches that were merged but not published yet
+  bool isPublishPending = false;
+  std::chrono::steady_clock::time_point timePublished;
+
+  std::unique_lock L(lock);
+  while (!shutdown) {
+    // New files are picked up at most every VIEW_POLL_INTERVAL_MS so that
+    // a stream of small batches doesn't keep rebuilding the whole view
+    cv.wait_for(L, std::chrono::milliseconds(VIEW_POLL_INTERVAL_MS),
+                [this]() { return shutdown || paramsChanged; });
+    if (shutdown) {
+      break;
+    }
+
+    if (paramsChanged) {
+      paramsChanged = false;
+      bool filterChanged = curParams.filter != params.filter ||
+                           curParams.filterCaseless != params.filterCaseless;
+      curIdRequest = idRequest;
+      curParams = params;
+      keys.clear();
+      matchIndices.clear();
+      sorted.clear();
+
+      if (filterChanged) {
+        filter.reset();
+        filterInvalid = false;
+        if (!curParams.filter.empty()) {
+          filter = std::make_unique<RefineFilter>();
+          if (!filter->Compile(curParams.filter, curParams.filterCaseless)) {
+            filter.reset();
+            filterInvalid = true;
+          }
+        }
+        // Lets the UI pick up the validity of the new filter
+        generation++;
+      }
+    }
+
+    if (source == nullptr || curParams.IsIdentity() || filterInvalid) {
+      continue;
+    }
+
+    while (!shutdown && !paramsChanged && source != nullptr &&
+           keys.size() < source->files.size()) {
+      ZoneScopedN("Build batch");
+      auto idxBegin = keys.size();
+      auto idxEnd = std::min(source->files.size(),
+                             idxBegin + (size_t)VIEW_MAX_KEYS_PER_BATCH);
+
+      // Forget() waits on `lockSource` after clearing `source`, so the UI
+      // isn't blocked while a batch is being filtered
+      auto *state = source;
+      std::unique_lock S(lockSource);
+      L.unlock();
+      MakeKeys(state, idxBegin, idxEnd);
+      S.unlock();
+
+      std::vector<uint32_t> newIndices;
+      for (auto idxFile = idxBegin; idxFile < idxEnd; idxFile++) {
+        if (keys[idxFile].isVisible) {
+          newIndices.push_back((uint32_t)idxFile);
+        }
+      }
+      SortNewKeys(newIndices);
+
+      {
+        ZoneScopedN("Merge");
+        auto numSorted = sorted.size();
+        sorted.insert(sorted.end(), newIndices.begin(), newIndices.end());
+        std::inplace_merge(sorted.begin(), sorted.begin() + numSorted,
+                           sorted.end(), [this](uint32_t lhs, uint32_t rhs) {
+                             return Less(lhs, rhs);
+                           });
+      }
+
+      // Each view is built from scratch, so while catching up with many
+      // batches only some of them are published
+      auto now = std::chrono::steady_clock::now();
+      isPublishPending = true;
+      if (now - timePublished >=
+          std::chrono::milliseconds(VIEW_POLL_INTERVAL_MS)) {
+        Publish();
+        timePublished = now;
+        isPublishPending = false;
+      }
+      L.lock();
+    }
+
+    if (isPublishPending && !paramsChanged) {
+      L.unlock();
+      Publish();
+      timePublished = std::chrono::steady_clock::now();
+      L.lock();
+    }
+    isPublishPending = false;
+  }
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ui.hpp"
+
+enum SortMode {
+  SORT_NONE = 0,
+  SORT_PATH,
+  SORT_MATCH_COUNT,
+  SORT_MTIME,
+  SORT_SIZE,
+  SORT_MAX
+};
+
+struct ViewParams {
+  SortMode sortMode = SORT_NONE;
+  bool groupByDirectory = false;
+  // Refine pattern; only files whose path below the root or whose matched
+  // lines contain it are shown. Empty means no filtering.
+  std::string filter;
+  bool filterCaseless = false;
+
+  bool operator==(const ViewParams &other) const {
+    return sortMode == other.sortMode &&
+           groupByDirectory == other.groupByDirectory &&
+           filter == other.filter && filterCaseless == other.filterCaseless;
+  }
+  bool operator!=(const ViewParams &other) const { return !(*this == other); }
+
+  // Whether the results are displayed in any other way than as published
+  bool IsIdentity() const {
+    return sortMode == SORT_NONE && !groupByDirectory && filter.empty();
+  }
+};
+
+// `offMatches` of file entries that show every match of the file
+static constexpr uint32_t VIEW_ALL_MATCHES = UINT32_MAX;
+
+struct ResultViewEntry {
+  uint32_t idxFile;
+  // Number of match rows below the file's header
+  uint32_t numMatches;
+  // Unless VIEW_ALL_MATCHES, the matches shown are
+  // ResultView::matchIndices[offMatches, offMatches + numMatches)
+  uint32_t offMatches;
+  // Directory headers take up a single row; `idxFile` is the first file of
+  // the group
+  bool isDirectoryHeader;
+};
+
+// Display order of the results of a request. Each entry is either a
+// directory header or a file (a header row followed by a row per match), and
+// `rowStart` holds the first row of each entry, so the entry at a given row
+// is found by binary search.
+struct ResultView {
+  uint64_t idRequest = 0;
+  ViewParams params;
+  // Files [0, numFiles) of the request are covered by this view
+  size_t numFiles = 0;
+
+  std::vector<ResultViewEntry> entries;
+  std::vector<size_t> rowStart;
+  size_t numRows = 0;
+  // Matches of the files that were only partially kept by the filter
+  std::vector<uint32_t> matchIndices;
+
+  void Clear(uint64_t idRequest);
+  void Append(const ResultViewEntry &entry);
+  // Appends the files published since the last call in publication order.
+  // Starts over when `state` belongs to a different request.
+  void AppendNewFiles(const UI_MatchRequestState *state);
+  bool Find(size_t &idxEntry, size_t &idxRowInEntry, size_t idxRow) const;
+
+  // Index into UI_File::matches of the `idxMatchInEntry`th match row of
+  // `entry`
+  size_t GetMatchIndex(const ResultViewEntry &entry,
+                       size_t idxMatchInEntry) const {
+    if (entry.offMatches == VIEW_ALL_MATCHES) {
+      return idxMatchInEntry;
+    }
+    return matchIndices[entry.offMatches + idxMatchInEntry];
+  }
+};
+
+struct RefineFilter;
+struct ViewHelpers;
+
+// Sorts, groups and filters the results of the current request on a
+// background thread. Newly published files are processed in parallel and
+// merged into the previous ordering, and finished views are swapped in
+// atomically.
+struct ViewBuilder {
+  ViewBuilder();
+  ~ViewBuilder();
+
+  ViewBuilder(const ViewBuilder &) = delete;
+  ViewBuilder &operator=(const ViewBuilder &) = delete;
+
+  // Cheap to call every frame; only wakes the builder when the parameters
+  // changed
+  void SetSource(const UI_MatchRequestState *state, const ViewParams &params);
+  // Must be called before `state` is destroyed. Blocks until the builder
+  // stopped reading from it.
+  void Forget(const UI_MatchRequestState *state);
+  // Latest finished view; may belong to an older request or older settings
+  std::shared_ptr<const ResultView> GetView() const;
+  // Set when the current filter pattern doesn't compile
+  bool IsFilterInvalid() const { return filterInvalid; }
+  // Bumped every time a view is published
+  uint64_t GetGeneration() const { return generation; }
+
+  struct SortKey {
+    // Only filled in when sorting or grouping by path
+    std::string path;
+    size_t lenDirectory;
+    size_t numMatches;
+    // UI_File::numMatchesCounted, for requests that only count
+    uint64_t numMatchesCounted;
+    uint64_t size;
+    int64_t mtime;
+    // Whether the file passed the filter and which of its matches did; see
+    // ResultViewEntry
+    bool isVisible;
+    uint32_t offMatches;
+  };
+
+  void ThreadProc();
+  void MakeKeys(const UI_MatchRequestState *state,
+                size_t idxBegin,
+                size_t idxEnd);
+  bool Less(uint32_t lhs, uint32_t rhs) const;
+  void SortNewKeys(std::vector<uint32_t> &indices);
+  void Publish();
+  // Started with the first batch that is worth splitting
+  ViewHelpers &GetHelpers();
+
+  std::thread thread;
+  mutable std::mutex lock;
+  std::condition_variable cv;
+  // Held by the builder while it reads from the source state
+  std::mutex lockSource;
+
+  // Guarded by `lock`
+  bool shutdown = false;
+  bool paramsChanged = false;
+  const UI_MatchRequestState *source = nullptr;
+  uint64_t idRequest = 0;
+  ViewParams params;
+
+  std::atomic<bool> filterInvalid{false};
+  std::atomic<uint64_t> generation{0};
+
+  // Owned by the builder thread; parameters of the view being built
+  uint64_t curIdRequest = 0;
+  ViewParams curParams;
+  std::unique_ptr<RefineFilter> filter;
+  std::unique_ptr<ViewHelpers> helpers;
+  std::vector<SortKey> keys;
+  std::vector<uint32_t> matchIndices;
+  std::vector<uint32_t> sorted;
+
+  std::shared_ptr<const ResultView> view;
+};
@@ -0,0 +1,159 @@
+#include "writeback.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+
+#include <fmt/core.h>
+
+// Distinguishes the temporary files of concurrent writers
+static std::atomic<uint64_t> gNextTempFile{0};
+
+static bool IsUnchanged(const std::string &path, const FileIdentity &expected) {
+  FileIdentity identity;
+  return FileId_Get(identity, path) && identity.SameContentsAs(expected);
+}
+
+static std::string GetTempPath(const std::filesystem::path &path,
+                               uint64_t idProcess) {
+  auto name = fmt::format(".{}.boringrep-{}-{}.tmp",
+                          path.filename().u8string(), idProcess,
+                          gNextTempFile++);
+  return (path.parent_path() / std::filesystem::u8path(name)).u8string();
+}
+
+#if WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+
+WriteBackStatus WriteBack_Replace(const std::string &path,
+                                  const FileIdentity &expected,
+                                  const void *buf,
+                                  size_t len) {
+  std::error_code ec;
+  auto target = std::filesystem::canonical(std::filesystem::u8path(path), ec);
+  if (ec) {
+    return WriteBack_Failure;
+  }
+  auto pathTarget = target.u8string();
+  if (!IsUnchanged(pathTarget, expected)) {
+    return WriteBack_Changed;
+  }
+
+  auto attributes = GetFileAttributesA(pathTarget.c_str());
+  if (attributes == INVALID_FILE_ATTRIBUTES) {
+    return WriteBack_Failure;
+  }
+
+  auto pathTemp = GetTempPath(target, GetCurrentProcessId());
+  auto handle = CreateFileA(pathTemp.c_str(), GENERIC_WRITE, 0, nullptr,
+                            CREATE_NEW, attributes & ~FILE_ATTRIBUTE_READONLY,
+                            nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return WriteBack_Failure;
+  }
+
+  auto *pBytes = (const char *)buf;
+  bool ok = true;
+  while (len > 0 && ok) {
+    DWORD lenChunk = (DWORD)std::min<size_t>(len, 1u << 30);
+    DWORD lenWritten = 0;
+    ok = WriteFile(handle, pBytes, lenChunk, &lenWritten, nullptr) &&
+         lenWritten == lenChunk;
+    pBytes += lenWritten;
+    len -= lenWritten;
+  }
+  // The rename must not be able to reach the disk before the contents
+  ok = ok && FlushFileBuffers(handle);
+  CloseHandle(handle);
+
+  if (!ok) {
+    DeleteFileA(pathTemp.c_str());
+    return WriteBack_Failure;
+  }
+
+  if (!IsUnchanged(pathTarget, expected)) {
+    DeleteFileA(pathTemp.c_str());
+    return WriteBack_Changed;
+  }
+
+  if (!MoveFileExA(pathTemp.c_str(), pathTarget.c_str(),
+                   MOVEFILE_REPLACE_EXISTING)) {
+    DeleteFileA(pathTemp.c_str());
+    return WriteBack_Failure;
+  }
+
+  return WriteBack_OK;
+}
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+
+WriteBackStatus WriteBack_Replace(const std::string &path,
+                                  const FileIdentity &expected,
+                                  const void *buf,
+                                  size_t len) {
+  std::error_code ec;
+  auto target = std::filesystem::canonical(path, ec);
+  if (ec) {
+    return WriteBack_Failure;
+  }
+  auto pathTarget = target.u8string();
+
+  struct stat st;
+  if (stat(pathTarget.c_str(), &st) != 0) {
+    return WriteBack_Failure;
+  }
+  if (!IsUnchanged(pathTarget, expected)) {
+    return WriteBack_Changed;
+  }
+
+  auto pathTemp = GetTempPath(target, getpid());
+  int fd = open(pathTemp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+                st.st_mode & 07777);
+  if (fd < 0) {
+    return WriteBack_Failure;
+  }
+  // Changing the owner may clear the setuid and setgid bits, so it comes
+  // first. The mode passed to open() is subject to the umask.
+  bool ok = fchown(fd, st.st_uid, st.st_gid) == 0 &&
+            fchmod(fd, st.st_mode & 07777) == 0;
+
+  auto *pBytes = (const char *)buf;
+  while (len > 0 && ok) {
+    auto lenWritten = write(fd, pBytes, len);
+    if (lenWritten < 0) {
+      ok = errno == EINTR;
+      continue;
+    }
+    pBytes += lenWritten;
+    len -= lenWritten;
+  }
+  // The rename must not be able to reach the disk before the contents
+  ok = ok && fsync(fd) == 0;
+  ok &= close(fd) == 0;
+
+  if (!ok) {
+    unlink(pathTemp.c_str());
+    return WriteBack_Failure;
+  }
+
+  if (!IsUnchanged(pathTarget, expected)) {
+    unlink(pathTemp.c_str());
+    return WriteBack_Changed;
+  }
+
+  if (rename(pathTemp.c_str(), pathTarget.c_str()) != 0) {
+    unlink(pathTemp.c_str());
+    return WriteBack_Failure;
+  }
+
+  return WriteBack_OK;
+}
+#endif
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include "fileid.hpp"
+
+enum WriteBackStatus {
+  WriteBack_OK,
+  // The file is no longer the one that `buf` was computed from
+  WriteBack_Changed,
+  WriteBack_Failure,
+};
+
+// Replaces the contents of `path` with `buf` by writing a temporary file next
+// to it and renaming it over the original, so that readers see either the old
+// or the new contents. Symlinks are resolved first, so that the link stays a
+// link. The new file takes the permissions (and on POSIX the owner) of the old
+// one, or the replacement fails, and its contents are flushed to disk before
+// the rename. Like with any rename, other hardlinks to the old file keep the
+// old contents. Nothing is written if the file's identity no longer matches
+// `expected`.
+WriteBackStatus WriteBack_Replace(const std::string &path,
+                                  const FileIdentity &expected,
+                                  const void *buf,
+                                  size_t len);